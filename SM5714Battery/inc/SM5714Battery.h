@@ -78,10 +78,75 @@ Abstract:
 #define DEVICE_NAME_SIZE 0x8
 #define CHEM_SIZE 0x4
 
+#define SM5714_FULL_CHARGED_CAPACITY_MWH    19228   // 4370mAh * 4.4V
+
+//
+// Telemetry older than this is refetched from the gauge, overridden by the
+// TelemetryMaxAgeMs value under the device hardware key. 0 disables caching.
+//
+
+#define SM5714_DEFAULT_TELEMETRY_MAX_AGE_MS 2000
+
+//
+// Background sampler tuning. The period starts at the fast rate, backs off
+// exponentially to the slow rate while readings are steady, and drops back
+// to the fast rate when the current swings or the charge is close to the
+// alert level. The sampler suspends itself when nobody has queried the
+// battery for the idle timeout and resumes on the next query or fuel gauge
+// alarm interrupt.
+//
+
+#define SM5714_SAMPLER_FAST_PERIOD_MS       2000
+#define SM5714_SAMPLER_SLOW_PERIOD_MS       30000
+#define SM5714_SAMPLER_IDLE_TIMEOUT_MS      120000
+#define SM5714_SAMPLER_CURRENT_DELTA_MA     100
+#define SM5714_SAMPLER_LOW_SOC              100     // 0.1 %
+#define SM5714_SAMPLER_NOTIFY_MARGIN_MWH    200
+
+//
+// Estimated time is derived from exponential moving averages of the gauge's
+// CURRENT_AVG and VBAT_AVG words, updated once per sample with weight
+// 1 / 2^SM5714_ESTIMATE_EMA_SHIFT. The averages are kept with
+// SM5714_ESTIMATE_EMA_FRACTION_BITS of fraction. Discharge below the
+// threshold is treated as idle and reported as unknown time.
+//
+
+#define SM5714_ESTIMATE_EMA_SHIFT           3
+#define SM5714_ESTIMATE_EMA_FRACTION_BITS   8
+#define SM5714_ESTIMATE_MIN_CURRENT_MA      5
+
+//
+// Bus circuit breaker. After SM5714_BUS_BREAKER_THRESHOLD consecutive
+// failed gauge reads the breaker opens for SM5714_BUS_BREAKER_OPEN_MS:
+// queries are answered from the last good sample without touching the
+// bus. The first read after that decides whether it closes or reopens.
+//
+
+#define SM5714_BUS_BREAKER_THRESHOLD        3
+#define SM5714_BUS_BREAKER_OPEN_MS          10000
+
 typedef struct {
     UNICODE_STRING                  RegistryPath;
 } SM5714_BATTERY_GLOBAL_DATA, *PSM5714_BATTERY_GLOBAL_DATA;
 
+//
+// Battery state published to lock-free readers. Timestamps are in
+// KeQueryInterruptTime units, the estimated time averages are fixed-point
+// with SM5714_ESTIMATE_EMA_FRACTION_BITS of fraction.
+//
+
+typedef struct {
+    SM5714_FG_TELEMETRY             Telemetry;
+    ULONGLONG                       TelemetryTimestamp;
+    BOOLEAN                         TelemetryValid;
+    ULONG                           CycleCount;
+    ULONGLONG                       CycleCountTimestamp;
+    BOOLEAN                         CycleCountValid;
+    LONGLONG                        EstimateCurrentAvg;
+    LONGLONG                        EstimateVoltageAvg;
+    BOOLEAN                         EstimateValid;
+} SM5714_BATTERY_SNAPSHOT, *PSM5714_BATTERY_SNAPSHOT;
+
 typedef struct {
     //
     // Device handle
@@ -107,6 +172,76 @@ typedef struct {
 
     WDFWAITLOCK                     StateLock;
     ULONG                           BatteryTag;
+
+    //
+    // Published telemetry. Writers hold StateLock and bracket every update
+    // with SnapshotSequence increments; readers copy the snapshot without
+    // a lock and retry while the sequence is odd or has moved.
+    //
+
+    volatile LONG                   SnapshotSequence;
+    SM5714_BATTERY_SNAPSHOT         Snapshot;
+    ULONG                           TelemetryMaxAgeMs;
+
+    //
+    // SramCompactReads value under the device hardware key. Requests the
+    // compacted SRAM read layout, which is only kept if it probes correctly.
+    //
+
+    BOOLEAN                         SramCompactReads;
+
+    //
+    // Single-flight refresh, protected by StateLock. RefreshDone is reset
+    // while a refresh is in flight; waiters share its RefreshStatus once
+    // RefreshGeneration has moved.
+    //
+
+    BOOLEAN                         RefreshInFlight;
+    ULONG                           RefreshGeneration;
+    NTSTATUS                        RefreshStatus;
+    KEVENT                          RefreshDone;
+
+    //
+    // Bus circuit breaker, protected by StateLock. BusBreakerOpenUntil is
+    // the interrupt time at which the breaker half-opens, 0 when closed.
+    //
+
+    ULONG                           BusFailureCount;
+    ULONGLONG                       BusBreakerOpenUntil;
+
+    //
+    // Background sampler, protected by StateLock
+    //
+
+    WDFTIMER                        SamplerTimer;
+    BOOLEAN                         SamplerEnabled;
+    BOOLEAN                         SamplerRunning;
+    ULONG                           SamplerPeriodMs;
+    LONG                            SamplerLastCurrentMa;
+
+    //
+    // Interrupt time of the last query, written by lock-free readers
+    //
+
+    volatile LONG64                 LastQueryTimestamp;
+
+    //
+    // Status notification window set by the class driver, protected by
+    // StateLock. The window is one-shot: it is disarmed once crossed until
+    // the class driver sets a new one.
+    //
+
+    BOOLEAN                         NotifyArmed;
+    BATTERY_NOTIFY                  Notify;
+
+    //
+    // Fuel gauge alarm interrupt, NULL when the device has no GpioInt
+    // resource. FgPendingFlags accumulates INTFG bits from the ISR until
+    // the work item consumes them.
+    //
+
+    WDFINTERRUPT                    FgInterrupt;
+    volatile LONG                   FgPendingFlags;
 } SM5714_BATTERY_FDO_DATA, *PSM5714_BATTERY_FDO_DATA;
 
 //------------------------------------------------------ WDF Context Declaration
@@ -122,9 +257,104 @@ SM5714BatteryPrepareHardware(
     _In_ WDFDEVICE Device
 );
 
+_IRQL_requires_same_
+VOID
+SM5714BatteryComputeStatus(
+    _In_ PSM5714_FG_TELEMETRY Telemetry,
+    _Out_ PBATTERY_STATUS BatteryStatus
+);
+
 BCLASS_QUERY_TAG_CALLBACK SM5714BatteryQueryTag;
 BCLASS_QUERY_INFORMATION_CALLBACK SM5714BatteryQueryInformation;
 BCLASS_SET_INFORMATION_CALLBACK SM5714BatterySetInformation;
 BCLASS_QUERY_STATUS_CALLBACK SM5714BatteryQueryStatus;
 BCLASS_SET_STATUS_NOTIFY_CALLBACK SM5714BatterySetStatusNotify;
-BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK SM5714BatteryDisableStatusNotify;
\ No newline at end of file
+BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK SM5714BatteryDisableStatusNotify;
+
+//----------------------------------------------------- Prototypes (telemetry.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SM5714BatteryLoadTelemetrySettings(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryGetTelemetry(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+    _Out_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryGetCycleCount(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+    _Out_ PULONG CycleCount
+);
+
+_IRQL_requires_same_
+VOID
+SM5714BatteryInvalidateTelemetry(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryCreateSampler(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SM5714BatteryStartSampler(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SM5714BatteryStopSampler(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+BOOLEAN
+SM5714BatteryEvaluateNotify(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SM5714BatteryClassNotify(
+    _In_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_same_
+ULONG
+SM5714BatteryGetEstimatedTime(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+    _In_ LONG AtRate
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SM5714BatteryHandleFgAlarm(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+    _In_ USHORT IntFlags
+);
+
+//----------------------------------------------------- Prototypes (interrupt.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryCreateFgInterrupt(
+    _In_ WDFDEVICE Device,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryInitializeFgInterrupt(
+    _Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
\ No newline at end of file
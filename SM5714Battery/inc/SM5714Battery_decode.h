@@ -0,0 +1,173 @@
+/*
+ * SM5714Battery_decode.h
+ *
+ * Conversions of Siliconmitus SM5714 Fuel Gauge SRAM words into engineering
+ * units. Free of any OS dependency, so the same code runs in the driver and
+ * in host side tooling. Every decoder has a scalar and a batch (array in,
+ * array out) entry point; the batch loops are branch free so the compiler can
+ * vectorize them.
+ *
+ * Building with SM5714_DECODE_USE_TABLES=1 replaces the voltage, current and
+ * temperature arithmetic with lookups into tables generated by the
+ * preprocessor at compile time. The tables (about 52 KB of read-only data)
+ * are defined once in src\decode.c, which has to be linked in that mode.
+ * Both paths return identical results.
+ */
+
+#ifndef SM5714BATTERY_DECODE
+#define SM5714BATTERY_DECODE
+
+#ifdef _MSC_VER
+#define SM5714_DECODE_INLINE static __inline
+#else
+#define SM5714_DECODE_INLINE static inline
+#endif
+
+#define SM5714_DECODE_RESTRICT __restrict
+
+//
+// All encodings are fixed-point with the sign (where present) in bit 15.
+// Scaling the masked magnitude first and shifting afterwards yields the same
+// result as decoding the integer and fraction parts separately:
+//
+//   SOC          8.8  percent  -> 0.1 %
+//   Voltage      3.11 volts    -> mV       (OCV, VBAT, VSYS, VBAT_AVG)
+//   Current      2.11 amps     -> mA       (CURRENT, CURRENT_AVG)
+//   Temperature  7.4  degrees  -> 0.1 degC (low nibble unused)
+//
+
+#define SM5714_FG_SOC_MASK                0xffff
+#define SM5714_FG_VOLTAGE_MASK            0x3fff
+#define SM5714_FG_CURRENT_MASK            0x1fff
+#define SM5714_FG_TEMPERATURE_MASK        0x7ff0
+#define SM5714_FG_SIGN_SHIFT              15
+
+#ifndef SM5714_DECODE_USE_TABLES
+#define SM5714_DECODE_USE_TABLES 0
+#endif
+
+// Arithmetic decode of a masked magnitude, shared by both paths
+#define SM5714_FG_VOLTAGE_MV(m)           ((((unsigned long)(m)) * 1000) >> 11)
+#define SM5714_FG_CURRENT_MA(m)           ((((unsigned long)(m)) * 1000) >> 11)
+#define SM5714_FG_TEMPERATURE_DECIC(m)    ((((unsigned long)(m)) * 10) >> 8)
+
+#if SM5714_DECODE_USE_TABLES
+
+//
+// Lookup tables, defined once in src\decode.c so every translation unit
+// including this header shares a single copy.
+//
+
+// Indexed by raw & SM5714_FG_VOLTAGE_MASK
+extern const unsigned short SM5714FgVoltageTable[SM5714_FG_VOLTAGE_MASK + 1];
+
+// Indexed by raw & SM5714_FG_CURRENT_MASK, magnitude only
+extern const unsigned short SM5714FgCurrentTable[SM5714_FG_CURRENT_MASK + 1];
+
+// Indexed by (raw & SM5714_FG_TEMPERATURE_MASK) >> 4, magnitude only
+extern const unsigned short SM5714FgTemperatureTable[(SM5714_FG_TEMPERATURE_MASK >> 4) + 1];
+
+#endif /* SM5714_DECODE_USE_TABLES */
+
+// Applies the sign bit of raw to a non-negative magnitude without branching
+SM5714_DECODE_INLINE long SM5714FgApplySign(unsigned short raw, long magnitude)
+{
+	long negative = -(long)(raw >> SM5714_FG_SIGN_SHIFT);
+
+	return (magnitude ^ negative) - negative;
+}
+
+SM5714_DECODE_INLINE unsigned long SM5714FgDecodeSoc(unsigned short raw)
+{
+	return ((unsigned long)(raw & SM5714_FG_SOC_MASK) * 10) >> 8;
+}
+
+#if SM5714_DECODE_USE_TABLES
+
+SM5714_DECODE_INLINE unsigned long SM5714FgDecodeVoltage(unsigned short raw)
+{
+	return SM5714FgVoltageTable[raw & SM5714_FG_VOLTAGE_MASK];
+}
+
+SM5714_DECODE_INLINE long SM5714FgDecodeCurrent(unsigned short raw)
+{
+	return SM5714FgApplySign(raw, SM5714FgCurrentTable[raw & SM5714_FG_CURRENT_MASK]);
+}
+
+SM5714_DECODE_INLINE long SM5714FgDecodeTemperature(unsigned short raw)
+{
+	return SM5714FgApplySign(raw, SM5714FgTemperatureTable[(raw & SM5714_FG_TEMPERATURE_MASK) >> 4]);
+}
+
+#else
+
+SM5714_DECODE_INLINE unsigned long SM5714FgDecodeVoltage(unsigned short raw)
+{
+	return SM5714_FG_VOLTAGE_MV(raw & SM5714_FG_VOLTAGE_MASK);
+}
+
+SM5714_DECODE_INLINE long SM5714FgDecodeCurrent(unsigned short raw)
+{
+	return SM5714FgApplySign(raw, (long)SM5714_FG_CURRENT_MA(raw & SM5714_FG_CURRENT_MASK));
+}
+
+SM5714_DECODE_INLINE long SM5714FgDecodeTemperature(unsigned short raw)
+{
+	return SM5714FgApplySign(raw, (long)SM5714_FG_TEMPERATURE_DECIC(raw & SM5714_FG_TEMPERATURE_MASK));
+}
+
+#endif /* SM5714_DECODE_USE_TABLES */
+
+SM5714_DECODE_INLINE void SM5714FgDecodeSocBatch(
+	const unsigned short* SM5714_DECODE_RESTRICT raw,
+	unsigned long* SM5714_DECODE_RESTRICT out,
+	unsigned long count)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+	{
+		out[i] = SM5714FgDecodeSoc(raw[i]);
+	}
+}
+
+SM5714_DECODE_INLINE void SM5714FgDecodeVoltageBatch(
+	const unsigned short* SM5714_DECODE_RESTRICT raw,
+	unsigned long* SM5714_DECODE_RESTRICT out,
+	unsigned long count)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+	{
+		out[i] = SM5714FgDecodeVoltage(raw[i]);
+	}
+}
+
+SM5714_DECODE_INLINE void SM5714FgDecodeCurrentBatch(
+	const unsigned short* SM5714_DECODE_RESTRICT raw,
+	long* SM5714_DECODE_RESTRICT out,
+	unsigned long count)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+	{
+		out[i] = SM5714FgDecodeCurrent(raw[i]);
+	}
+}
+
+SM5714_DECODE_INLINE void SM5714FgDecodeTemperatureBatch(
+	const unsigned short* SM5714_DECODE_RESTRICT raw,
+	long* SM5714_DECODE_RESTRICT out,
+	unsigned long count)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+	{
+		out[i] = SM5714FgDecodeTemperature(raw[i]);
+	}
+}
+
+#endif /* SM5714BATTERY_DECODE */
@@ -14,6 +14,14 @@
 #define SM5714_FG_REG_STATUS              0x03
 #define SM5714_FG_REG_INTFG_MASK          0x04
 
+// INTFG / INTFG_MASK bits, a set mask bit disables the interrupt
+#define SM5714_FG_INT_LOW_VOLTAGE         0x0001
+#define SM5714_FG_INT_LOW_TEMPERATURE     0x0002
+#define SM5714_FG_INT_HIGH_TEMPERATURE    0x0004
+#define SM5714_FG_INT_LOW_SOC             0x0008
+#define SM5714_FG_INT_ALARMS              (SM5714_FG_INT_LOW_VOLTAGE | SM5714_FG_INT_LOW_TEMPERATURE | \
+                                           SM5714_FG_INT_HIGH_TEMPERATURE | SM5714_FG_INT_LOW_SOC)
+
 #define SM5714_FG_REG_SRAM_PROT		      0x8B
 #define SM5714_FG_REG_SRAM_RADDR		  0x8C
 #define SM5714_FG_REG_SRAM_RDATA		  0x8D
@@ -32,11 +40,13 @@
 #define SM5714_FG_ADDR_SRAM_STATE         0x15
 #define SM5714_FG_ADDR_SRAM_SOC_CYCLE	  0x87
 
-// Converts 8.8 fixed-point format into standard integer scaled by extend_orders
-#define FIXED_POINT_8_8_EXTEND_TO_INT(fp_value, extend_orders) ((((fp_value & 0xff00) >> 8) * extend_orders) + (((fp_value & 0xff) * extend_orders) / 256))
+// Contiguous SRAM window covering SOC through CURRENT_AVG
+#define SM5714_FG_SRAM_TELEMETRY_FIRST    SM5714_FG_ADDR_SRAM_SOC
+#define SM5714_FG_SRAM_TELEMETRY_COUNT    (SM5714_FG_ADDR_SRAM_CURRENT_AVG - SM5714_FG_SRAM_TELEMETRY_FIRST + 1)
+#define SM5714_FG_SRAM_TELEMETRY_INDEX(addr) ((addr) - SM5714_FG_SRAM_TELEMETRY_FIRST)
 
 // Read data register
-unsigned char readCmd = (unsigned char)SM5714_FG_REG_SRAM_RDATA;
+static unsigned char readCmd = (unsigned char)SM5714_FG_REG_SRAM_RDATA;
 
 // 3 byte variables for passing to first SpbWriteRead sequence
 static const UCHAR write_state[3] = { (UCHAR)SM5714_FG_REG_SRAM_RADDR, (UCHAR)SM5714_FG_ADDR_SRAM_STATE, 0 };
@@ -0,0 +1,250 @@
+/*
+ * SM5714Battery_trace.h
+ *
+ * Binary I2C transaction records kept by the SM5714 battery driver in a
+ * fixed-size ring, its I2C transfer statistics, and the private IOCTLs that
+ * read them out. Header only and
+ * free of any OS dependency apart from the IOCTL code, so host side tooling
+ * can include it to decode the drained buffer with SM5714I2cTraceFormat.
+ * Fields use int rather than long so the layout is the same on LLP64 and
+ * LP64 hosts.
+ */
+
+#ifndef SM5714BATTERY_TRACE
+#define SM5714BATTERY_TRACE
+
+#ifdef _MSC_VER
+#define SM5714_TRACE_INLINE static __inline
+#else
+#define SM5714_TRACE_INLINE static inline
+#endif
+
+#define SM5714_I2C_TRACE_VERSION          1
+
+//
+// Bytes of payload kept per record: the bytes sent followed by the bytes
+// received, truncated to this size. SendLength and ReceiveLength keep the
+// full lengths of the transaction.
+//
+#define SM5714_I2C_TRACE_PAYLOAD_SIZE     24
+
+// Record types
+#define SM5714_I2C_TRACE_WRITE            1   // Plain write, register then data
+#define SM5714_I2C_TRACE_READ             2   // Register pointer write, then read
+#define SM5714_I2C_TRACE_WRITE_READ       3   // SRAM RADDR + RDATA writes, then read
+#define SM5714_I2C_TRACE_SRAM_READ        4   // Batched SRAM word reads
+#define SM5714_I2C_TRACE_INTERRUPT_READ   5   // INTFG and STATUS read
+
+typedef struct _SM5714_I2C_TRACE_RECORD
+{
+	// Position in the ring's history, starting at 1. 0 marks an empty or
+	// partially written record.
+	unsigned long long Sequence;
+
+	// Interrupt time at the start of the transaction, 100 ns units
+	unsigned long long Timestamp;
+
+	unsigned int DurationUs;
+	int Status;
+	unsigned char Type;
+	unsigned char Register;
+	unsigned short SendLength;
+	unsigned short ReceiveLength;
+	unsigned short Reserved;
+	unsigned char Payload[SM5714_I2C_TRACE_PAYLOAD_SIZE];
+} SM5714_I2C_TRACE_RECORD;
+
+//
+// IOCTL_SM5714_BATTERY_READ_I2C_TRACE
+//
+// Input:  unsigned long long, the last Sequence already seen (0 for all)
+// Output: SM5714_I2C_TRACE_HEADER followed by RecordCount records newer
+//         than the input, oldest first. Records that were overwritten
+//         before the drain are reported in Dropped. LastSequence is the
+//         input for the next drain.
+//
+typedef struct _SM5714_I2C_TRACE_HEADER
+{
+	unsigned int Version;
+	unsigned int RecordSize;
+	unsigned int RecordCount;
+	unsigned int Dropped;
+	unsigned long long LastSequence;
+} SM5714_I2C_TRACE_HEADER;
+
+//
+// Cumulative I2C transfer statistics. Errors includes Timeouts. Latency is
+// bucketed by powers of two in microseconds: bucket 0 counts transfers
+// faster than 2 us, bucket n those taking [2^n, 2^(n+1)) us and the last
+// bucket everything slower.
+//
+#define SM5714_SPB_LATENCY_BUCKETS        20
+
+typedef struct _SM5714_SPB_STATISTICS
+{
+	unsigned long long Transfers;
+	unsigned long long Bytes;
+	unsigned long long Errors;
+	unsigned long long Timeouts;
+	unsigned long long BusTimeUs;
+	unsigned long long LatencyBuckets[SM5714_SPB_LATENCY_BUCKETS];
+} SM5714_SPB_STATISTICS;
+
+#ifdef CTL_CODE
+#define IOCTL_SM5714_BATTERY_READ_I2C_TRACE \
+	CTL_CODE(FILE_DEVICE_BATTERY, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Input: none. Output: SM5714_SPB_STATISTICS.
+//
+#define IOCTL_SM5714_BATTERY_READ_SPB_STATISTICS \
+	CTL_CODE(FILE_DEVICE_BATTERY, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
+
+SM5714_TRACE_INLINE const char* SM5714I2cTraceTypeName(unsigned char type)
+{
+	switch (type)
+	{
+	case SM5714_I2C_TRACE_WRITE:          return "WRITE";
+	case SM5714_I2C_TRACE_READ:           return "READ";
+	case SM5714_I2C_TRACE_WRITE_READ:     return "WRITE_READ";
+	case SM5714_I2C_TRACE_SRAM_READ:      return "SRAM_READ";
+	case SM5714_I2C_TRACE_INTERRUPT_READ: return "INTERRUPT_READ";
+	default:                              return "UNKNOWN";
+	}
+}
+
+//
+// Formats a record as one line of text:
+//
+//   <sequence> <time us> <type> reg=<XX> <duration>us status=<XXXXXXXX> tx=<hex> rx=<hex>
+//
+// Returns the number of characters written, not counting the terminator.
+// The output is truncated to fit size and always terminated when size > 0.
+//
+SM5714_TRACE_INLINE unsigned long SM5714I2cTraceFormat(
+	const SM5714_I2C_TRACE_RECORD* record,
+	char* out,
+	unsigned long size)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char line[96 + SM5714_I2C_TRACE_PAYLOAD_SIZE * 3];
+	char number[24];
+	const char* type;
+	unsigned long long value;
+	unsigned long length = 0;
+	unsigned long sent;
+	unsigned long kept;
+	unsigned long i;
+	int n;
+	int pass;
+
+#define SM5714_TRACE_PUT(c) (line[length++] = (c))
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		value = pass == 0 ? record->Sequence : record->Timestamp / 10;
+		n = 0;
+		do
+		{
+			number[n++] = (char)('0' + value % 10);
+			value /= 10;
+		} while (value != 0);
+
+		while (n > 0)
+		{
+			SM5714_TRACE_PUT(number[--n]);
+		}
+
+		SM5714_TRACE_PUT(' ');
+	}
+
+	for (type = SM5714I2cTraceTypeName(record->Type); *type != '\0'; type++)
+	{
+		SM5714_TRACE_PUT(*type);
+	}
+
+	SM5714_TRACE_PUT(' ');
+	SM5714_TRACE_PUT('r');
+	SM5714_TRACE_PUT('e');
+	SM5714_TRACE_PUT('g');
+	SM5714_TRACE_PUT('=');
+	SM5714_TRACE_PUT(digits[record->Register >> 4]);
+	SM5714_TRACE_PUT(digits[record->Register & 0xf]);
+	SM5714_TRACE_PUT(' ');
+
+	value = record->DurationUs;
+	n = 0;
+	do
+	{
+		number[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	while (n > 0)
+	{
+		SM5714_TRACE_PUT(number[--n]);
+	}
+
+	SM5714_TRACE_PUT('u');
+	SM5714_TRACE_PUT('s');
+	SM5714_TRACE_PUT(' ');
+
+	for (type = "status="; *type != '\0'; type++)
+	{
+		SM5714_TRACE_PUT(*type);
+	}
+
+	for (n = 28; n >= 0; n -= 4)
+	{
+		SM5714_TRACE_PUT(digits[((unsigned int)record->Status >> n) & 0xf]);
+	}
+
+	sent = record->SendLength;
+	if (sent > SM5714_I2C_TRACE_PAYLOAD_SIZE)
+	{
+		sent = SM5714_I2C_TRACE_PAYLOAD_SIZE;
+	}
+
+	kept = sent + record->ReceiveLength;
+	if (kept > SM5714_I2C_TRACE_PAYLOAD_SIZE)
+	{
+		kept = SM5714_I2C_TRACE_PAYLOAD_SIZE;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if (i == 0 || i == sent)
+		{
+			SM5714_TRACE_PUT(' ');
+			SM5714_TRACE_PUT(i < sent ? 't' : 'r');
+			SM5714_TRACE_PUT('x');
+			SM5714_TRACE_PUT('=');
+		}
+
+		SM5714_TRACE_PUT(digits[record->Payload[i] >> 4]);
+		SM5714_TRACE_PUT(digits[record->Payload[i] & 0xf]);
+	}
+
+#undef SM5714_TRACE_PUT
+
+	if (size == 0)
+	{
+		return length;
+	}
+
+	if (length > size - 1)
+	{
+		length = size - 1;
+	}
+
+	for (i = 0; i < length; i++)
+	{
+		out[i] = line[i];
+	}
+
+	out[length] = '\0';
+	return length;
+}
+
+#endif /* SM5714BATTERY_TRACE */
@@ -22,11 +22,116 @@
 
 #include <wdm.h>
 #include <wdf.h>
+#include "SM5714Battery_trace.h"
 
 #define DEFAULT_SPB_BUFFER_SIZE 64
 
+//
+// Transfer deadline and retry policy. Every transfer is cancelled after
+// SPB_TRANSFER_TIMEOUT_US. Transfers failing with a bus protocol error or
+// an address NACK are retried up to SPB_TRANSFER_MAX_ATTEMPTS times in
+// total, waiting SPB_RETRY_BACKOFF_US before the first retry and doubling
+// up to SPB_RETRY_BACKOFF_MAX_US after that.
+//
+#define SPB_TRANSFER_TIMEOUT_US 50000
+#define SPB_TRANSFER_MAX_ATTEMPTS 3
+#define SPB_RETRY_BACKOFF_US 500
+#define SPB_RETRY_BACKOFF_MAX_US 4000
+
+//
+// Size of the lookaside buffers used for transfers that do not fit the
+// default buffers. Only transfers larger than this allocate from pool.
+//
+#define LARGE_SPB_BUFFER_SIZE 512
+
+//
+// Number of records in the I2C transaction trace ring, a power of two
+//
+#define SPB_TRACE_RING_SIZE 256
+
+C_ASSERT((SPB_TRACE_RING_SIZE & (SPB_TRACE_RING_SIZE - 1)) == 0);
+
+//
+// Debug builds count pool allocations made on the transfer path, which
+// must stay at zero in steady state
+//
+#if DBG
+#define SPB_COUNT_TRANSFER(SpbContext) InterlockedIncrement(&(SpbContext)->TransferCount)
+#define SPB_COUNT_ALLOCATION(SpbContext) InterlockedIncrement(&(SpbContext)->AllocationCount)
+#else
+#define SPB_COUNT_TRANSFER(SpbContext)
+#define SPB_COUNT_ALLOCATION(SpbContext)
+#endif
+
+//
+// Maximum number of SRAM words fetched by a single SpbReadSramWords sequence.
+// Each word costs three transfer list entries (RADDR, RDATA, read).
+//
+#define SPB_MAX_SRAM_READS SM5714_FG_TELEMETRY_WORDS
+
+//
+// Maximum number of SRAM words the submission queue combines into one
+// sequence across all waiting callers. This bounds the sequence buffer
+// carried by every pool slot.
+//
+#define SPB_MAX_COMBINED_READS (SPB_MAX_SRAM_READS * 2)
+
 #define SPB_POOL_TAG 'bpSB'
 
+//
+// Number of preallocated requests available for concurrent sequences.
+// Must not exceed the bits of SPB_CONTEXT::RequestFreeMask.
+//
+#define SPB_REQUEST_POOL_SIZE 4
+
+//
+// Called when an asynchronous sequence completes, at IRQL <= DISPATCH_LEVEL
+//
+typedef
+VOID
+SPB_SEQUENCE_COMPLETION(
+	_In_ NTSTATUS Status,
+	_In_ ULONG BytesReturned,
+	_In_opt_ PVOID Context
+);
+
+typedef SPB_SEQUENCE_COMPLETION *PFN_SPB_SEQUENCE_COMPLETION;
+
+struct _SPB_CONTEXT;
+
+//
+// A preallocated request with its own sequence buffer, reused across
+// transfers instead of creating objects per transfer
+//
+
+typedef struct _SPB_REQUEST_SLOT
+{
+	struct _SPB_CONTEXT* SpbContext;
+	WDFREQUEST Request;
+	WDFMEMORY SequenceMemory;
+	ULONG Index;
+	PFN_SPB_SEQUENCE_COMPLETION Completion;
+	PVOID CompletionContext;
+} SPB_REQUEST_SLOT;
+
+//
+// An SRAM read waiting in the submission queue. It lives on the stack of
+// the caller, which waits on Done until the read has been carried out.
+// Promoted is set instead when the caller has to send the next batch.
+//
+
+typedef struct _SPB_READ_SUBMISSION
+{
+	LIST_ENTRY ListEntry;
+	const UCHAR* Addresses;
+	PUSHORT Words;
+	ULONG Count;
+	ULONG DelayUs;
+	NTSTATUS Status;
+	BOOLEAN Promoted;
+	KEVENT Done;
+} SPB_READ_SUBMISSION;
+
 //
 // SPB (I2C) context
 //
@@ -38,8 +143,83 @@ typedef struct _SPB_CONTEXT
 	WDFMEMORY WriteMemory;
 	WDFMEMORY ReadMemory;
 	WDFWAITLOCK SpbLock;
+
+	//
+	// Set by SpbProbeSramAutoIncrement when RDATA reads walk forward
+	// through SRAM, allowing a whole address window in one read transfer
+	//
+	BOOLEAN SramAutoIncrement;
+
+	//
+	// Set by SpbProbeSramCompactReads when the RADDR and RDATA writes of an
+	// SRAM read can share one ToDevice buffer list entry. Off by default,
+	// some controllers need the split three-entry layout.
+	//
+	BOOLEAN SramCompactReads;
+
+	//
+	// SRAM read submission queue, protected by SubmissionLock. While
+	// SubmissionActive is set one caller owns the queue and sends the
+	// pending reads as one sequence; other callers wait to be completed
+	// or promoted to the next owner.
+	//
+	WDFWAITLOCK SubmissionLock;
+	LIST_ENTRY SubmissionQueue;
+	BOOLEAN SubmissionActive;
+
+	//
+	// Request pool for sequence transfers. A set bit in RequestFreeMask
+	// marks a free slot, RequestPoolSemaphore counts them.
+	//
+	SPB_REQUEST_SLOT RequestPool[SPB_REQUEST_POOL_SIZE];
+	volatile LONG RequestFreeMask;
+	KSEMAPHORE RequestPoolSemaphore;
+
+	//
+	// Backing for transfers larger than DEFAULT_SPB_BUFFER_SIZE
+	//
+	WDFLOOKASIDE LargeBufferLookaside;
+
+	//
+	// I2C transaction trace ring. TraceSequence is the sequence of the
+	// newest record claimed; a record lives at its sequence modulo the
+	// ring size and publishes its Sequence field last.
+	//
+	volatile LONG64 TraceSequence;
+	SM5714_I2C_TRACE_RECORD TraceRing[SPB_TRACE_RING_SIZE];
+
+	//
+	// Transfer statistics, updated with interlocked operations.
+	// PerformanceFrequency converts KeQueryPerformanceCounter ticks.
+	//
+	SM5714_SPB_STATISTICS Statistics;
+	LARGE_INTEGER PerformanceFrequency;
+
+#if DBG
+	volatile LONG TransferCount;
+	volatile LONG AllocationCount;
+#endif
 } SPB_CONTEXT;
 
+//
+// Decoded fuel gauge SRAM telemetry window (SOC through CURRENT_AVG)
+//
+
+#define SM5714_FG_TELEMETRY_WORDS 10
+
+typedef struct _SM5714_FG_TELEMETRY
+{
+	USHORT Raw[SM5714_FG_TELEMETRY_WORDS];
+	ULONG Soc;                  // 0.1 %
+	ULONG OcvMv;
+	ULONG VbatMv;
+	ULONG VsysMv;
+	LONG CurrentMa;
+	LONG TemperatureDeciC;
+	ULONG VbatAvgMv;
+	LONG CurrentAvgMa;
+} SM5714_FG_TELEMETRY, *PSM5714_FG_TELEMETRY;
+
 NTSTATUS
 SpbWriteRead(
 	_In_                            SPB_CONTEXT* SpbContext,
@@ -52,6 +232,77 @@ SpbWriteRead(
 	_In_                            ULONG           DelayUs
 );
 
+NTSTATUS
+SpbReadSramWords(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Addresses,
+	_Out_writes_(Count)             PUSHORT         Words,
+	_In_                            ULONG           Count,
+	_In_                            ULONG           DelayUs
+);
+
+NTSTATUS
+SpbReadSramRange(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            UCHAR           StartAddress,
+	_Out_writes_(Count)             PUSHORT         Words,
+	_In_                            ULONG           Count
+);
+
+NTSTATUS
+SpbReadTelemetry(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           PSM5714_FG_TELEMETRY Telemetry
+);
+
+NTSTATUS
+SpbProbeSramAutoIncrement(
+	_In_                            SPB_CONTEXT*    SpbContext
+);
+
+NTSTATUS
+SpbProbeSramCompactReads(
+	_In_                            SPB_CONTEXT*    SpbContext
+);
+
+NTSTATUS
+SpbReadFgInterrupt(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           PUSHORT         IntFlags,
+	_Out_                           PUSHORT         FgStatus
+);
+
+NTSTATUS
+SpbWriteFgInterruptMask(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            USHORT          Mask
+);
+
+NTSTATUS
+SpbSequenceAsync(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_bytes_(SequenceLength) PVOID          Sequence,
+	_In_                            SIZE_T          SequenceLength,
+	_In_                            ULONG           TimeoutUs,
+	_In_                            PFN_SPB_SEQUENCE_COMPLETION Completion,
+	_In_opt_                        PVOID           Context
+);
+
+NTSTATUS
+SpbTraceDrain(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            ULONGLONG       AfterSequence,
+	_Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+	_In_                            ULONG           BufferLength,
+	_Out_                           PULONG          BytesWritten
+);
+
+VOID
+SpbQueryStatistics(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           SM5714_SPB_STATISTICS* Statistics
+);
+
 NTSTATUS
 SpbReadDataSynchronously(
 	IN SPB_CONTEXT* SpbContext,
@@ -24,32 +24,148 @@
 
 #include "..\inc\SM5714Battery.h"
 #include "..\inc\Spb.h"
+#include "..\inc\SM5714Battery_regs.h"
+#include "..\inc\SM5714Battery_decode.h"
 #include <spb.tmh>
 #include <reshub.h>
 #include <spb.h>
 
-#define I2C_VERBOSE_LOGGING 1
+C_ASSERT(SM5714_FG_TELEMETRY_WORDS == SM5714_FG_SRAM_TELEMETRY_COUNT);
+
+SPB_REQUEST_SLOT*
+SpbAcquireRequestSlot(
+	_In_                        SPB_CONTEXT* SpbContext
+);
+
+VOID
+SpbReleaseRequestSlot(
+	_In_                        SPB_REQUEST_SLOT* Slot
+);
+
+ULONGLONG
+SpbTraceStart(
+	VOID
+)
+/*++
+
+  Routine Description:
+
+	This helper routine timestamps the start of a traced transaction.
+
+  Return Value:
+
+	The interrupt time in 100 ns units
+
+--*/
+{
+	return KeQueryInterruptTimePrecise(NULL);
+}
+
+VOID
+SpbTraceTransaction(
+	_In_                        SPB_CONTEXT* SpbContext,
+	_In_                        UCHAR Type,
+	_In_                        UCHAR Register,
+	_In_reads_bytes_opt_(SendLength) const VOID* SendData,
+	_In_                        ULONG SendLength,
+	_In_reads_bytes_opt_(ReceiveLength) const VOID* ReceiveData,
+	_In_                        ULONG ReceiveLength,
+	_In_                        NTSTATUS Status,
+	_In_                        ULONGLONG StartTime
+)
+/*++
+
+  Routine Description:
+
+	This helper routine appends a transaction record to the trace ring.
+	Writers claim a slot with one interlocked increment and never wait;
+	the record's Sequence is cleared while it is filled and published
+	last, so SpbTraceDrain skips records caught mid-update.
+
+  Arguments:
+
+	SpbContext    - Pointer to the current device context
+	Type          - SM5714_I2C_TRACE_* type of the transaction
+	Register      - The register or SRAM address addressed first
+	SendData      - The bytes sent, may be NULL
+	SendLength    - The number of bytes sent
+	ReceiveData   - The bytes received, may be NULL
+	ReceiveLength - The number of bytes received
+	Status        - The status of the transaction
+	StartTime     - The value returned by SpbTraceStart
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SM5714_I2C_TRACE_RECORD* record;
+	ULONGLONG sequence;
+	ULONGLONG endTime;
+	ULONG sent;
+	ULONG received;
+
+	endTime = KeQueryInterruptTimePrecise(NULL);
+	sequence = (ULONGLONG)InterlockedIncrement64(&SpbContext->TraceSequence);
+	record = &SpbContext->TraceRing[sequence & (SPB_TRACE_RING_SIZE - 1)];
+
+	WriteNoFence64((volatile LONG64*)&record->Sequence, 0);
+	KeMemoryBarrier();
+
+	record->Timestamp = StartTime;
+	record->DurationUs = (ULONG)((endTime - StartTime) / 10);
+	record->Status = Status;
+	record->Type = Type;
+	record->Register = Register;
+	record->SendLength = (USHORT)SendLength;
+	record->ReceiveLength = (USHORT)ReceiveLength;
+	record->Reserved = 0;
+
+	sent = (SendData == NULL) ? 0 : min(SendLength, SM5714_I2C_TRACE_PAYLOAD_SIZE);
+	received = (ReceiveData == NULL || !NT_SUCCESS(Status)) ?
+		0 : min(ReceiveLength, SM5714_I2C_TRACE_PAYLOAD_SIZE - sent);
+
+	if (sent != 0)
+	{
+		RtlCopyMemory(record->Payload, SendData, sent);
+	}
+
+	if (received != 0)
+	{
+		RtlCopyMemory(record->Payload + sent, ReceiveData, received);
+	}
+
+	RtlZeroMemory(record->Payload + sent + received, SM5714_I2C_TRACE_PAYLOAD_SIZE - sent - received);
+
+	WriteRelease64((volatile LONG64*)&record->Sequence, (LONG64)sequence);
+}
 
 NTSTATUS
-SpbDoWriteDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	IN PVOID Data,
-	IN ULONG Length
+SpbTraceDrain(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            ULONGLONG       AfterSequence,
+	_Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+	_In_                            ULONG           BufferLength,
+	_Out_                           PULONG          BytesWritten
 )
 /*++
 
   Routine Description:
 
-	This helper routine abstracts creating and sending an I/O
-	request (I2C Write) to the Spb I/O target.
+	This routine copies the trace records newer than AfterSequence, oldest
+	first, into an SM5714_I2C_TRACE_HEADER laid out buffer. It runs
+	concurrently with writers: records overwritten before they could be
+	copied are counted as dropped, and the drain stops at the first record
+	still being written.
 
   Arguments:
 
-	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to write to
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
+	SpbContext    - Pointer to the current device context
+	AfterSequence - The last sequence the caller has already seen
+	Buffer        - Receives the header and the records
+	BufferLength  - The size of Buffer in bytes
+	BytesWritten  - Receives the number of bytes used in Buffer
 
   Return Value:
 
@@ -57,123 +173,277 @@ SpbDoWriteDataSynchronously(
 
 --*/
 {
-	PUCHAR buffer;
-	ULONG length;
-	WDFMEMORY memory;
-	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
-	NTSTATUS status;
+	SM5714_I2C_TRACE_HEADER* header;
+	SM5714_I2C_TRACE_RECORD* records;
+	SM5714_I2C_TRACE_RECORD* record;
+	ULONGLONG newest;
+	ULONGLONG sequence;
+	ULONG capacity;
 
-	//
-	// The address pointer and data buffer must be combined
-	// into one contiguous buffer representing the write transaction.
-	//
-	length = Length + 1;
-	memory = NULL;
+	*BytesWritten = 0;
 
-	if (length > DEFAULT_SPB_BUFFER_SIZE)
+	if (BufferLength < sizeof(SM5714_I2C_TRACE_HEADER))
 	{
-		status = WdfMemoryCreate(
-			WDF_NO_OBJECT_ATTRIBUTES,
-			NonPagedPool,
-			SPB_POOL_TAG,
-			length,
-			&memory,
-			&buffer);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
 
-		if (!NT_SUCCESS(status))
+	header = (SM5714_I2C_TRACE_HEADER*)Buffer;
+	records = (SM5714_I2C_TRACE_RECORD*)(header + 1);
+	capacity = (BufferLength - sizeof(*header)) / sizeof(*records);
+
+	header->Version = SM5714_I2C_TRACE_VERSION;
+	header->RecordSize = sizeof(*records);
+	header->RecordCount = 0;
+	header->Dropped = 0;
+
+	newest = (ULONGLONG)ReadAcquire64(&SpbContext->TraceSequence);
+	sequence = AfterSequence + 1;
+
+	if (newest >= SPB_TRACE_RING_SIZE &&
+		sequence <= newest - SPB_TRACE_RING_SIZE)
+	{
+		header->Dropped = (ULONG)min(newest - SPB_TRACE_RING_SIZE + 1 - sequence, MAXULONG);
+		sequence = newest - SPB_TRACE_RING_SIZE + 1;
+	}
+
+	for (; sequence <= newest && header->RecordCount < capacity; sequence++)
+	{
+		record = &SpbContext->TraceRing[sequence & (SPB_TRACE_RING_SIZE - 1)];
+
+		if ((ULONGLONG)ReadAcquire64((volatile LONG64*)&record->Sequence) != sequence)
 		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				SM5714_BATTERY_ERROR,
-				"Error allocating memory for Spb write - 0x%08lX",
-				status);
-			goto exit;
+			//
+			// Either still being written, or already lapped by a newer
+			// record. Stop at the former so it is picked up next time.
+			//
+			if ((ULONGLONG)ReadAcquire64(&SpbContext->TraceSequence) - sequence < SPB_TRACE_RING_SIZE)
+			{
+				break;
+			}
+
+			header->Dropped += 1;
+			continue;
 		}
 
-		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
-			&memoryDescriptor,
-			memory,
-			NULL);
+		records[header->RecordCount] = *record;
+		KeMemoryBarrier();
+
+		if ((ULONGLONG)ReadNoFence64((volatile LONG64*)&record->Sequence) != sequence)
+		{
+			header->Dropped += 1;
+			continue;
+		}
+
+		header->RecordCount += 1;
+	}
+
+	header->LastSequence = sequence - 1;
+	*BytesWritten = sizeof(*header) + header->RecordCount * sizeof(*records);
+
+	return STATUS_SUCCESS;
+}
+
+LARGE_INTEGER
+SpbStatisticsStart(
+	VOID
+)
+/*++
+
+  Routine Description:
+
+	This helper routine timestamps the start of a transfer for
+	SpbStatisticsRecord.
+
+  Return Value:
+
+	The performance counter
+
+--*/
+{
+	return KeQueryPerformanceCounter(NULL);
+}
+
+VOID
+SpbStatisticsRecord(
+	_In_                        SPB_CONTEXT* SpbContext,
+	_In_                        LARGE_INTEGER StartTime,
+	_In_                        ULONG Bytes,
+	_In_                        NTSTATUS Status
+)
+/*++
+
+  Routine Description:
+
+	This helper routine accounts one bus transfer in the context's
+	statistics and latency histogram.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	StartTime  - The value returned by SpbStatisticsStart
+	Bytes      - The number of bytes moved over the bus
+	Status     - The status of the transfer
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SM5714_SPB_STATISTICS* statistics = &SpbContext->Statistics;
+	LARGE_INTEGER endTime;
+	ULONGLONG elapsedUs;
+	ULONG bucket;
+
+	endTime = KeQueryPerformanceCounter(NULL);
+	elapsedUs = ((ULONGLONG)(endTime.QuadPart - StartTime.QuadPart) * 1000000) /
+		(ULONGLONG)SpbContext->PerformanceFrequency.QuadPart;
+
+	if (elapsedUs < 2)
+	{
+		bucket = 0;
+	}
+	else if (elapsedUs > MAXULONG)
+	{
+		bucket = SM5714_SPB_LATENCY_BUCKETS - 1;
 	}
 	else
 	{
-		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->WriteMemory, NULL);
+		_BitScanReverse(&bucket, (ULONG)elapsedUs);
+		bucket = min(bucket, SM5714_SPB_LATENCY_BUCKETS - 1);
+	}
+
+	InterlockedIncrement64((volatile LONG64*)&statistics->Transfers);
+	InterlockedAdd64((volatile LONG64*)&statistics->Bytes, Bytes);
+	InterlockedAdd64((volatile LONG64*)&statistics->BusTimeUs, (LONG64)elapsedUs);
+	InterlockedIncrement64((volatile LONG64*)&statistics->LatencyBuckets[bucket]);
+
+	if (!NT_SUCCESS(Status))
+	{
+		InterlockedIncrement64((volatile LONG64*)&statistics->Errors);
 
-		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
-			&memoryDescriptor,
-			(PVOID)buffer,
-			length);
+		if (Status == STATUS_IO_TIMEOUT)
+		{
+			InterlockedIncrement64((volatile LONG64*)&statistics->Timeouts);
+		}
 	}
+}
 
-	//
-	// Transaction starts by specifying the address bytes
-	//
-	RtlCopyMemory(buffer, &Address, sizeof(Address));
+VOID
+SpbQueryStatistics(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           SM5714_SPB_STATISTICS* Statistics
+)
+/*++
 
-	//
-	// Address is followed by the data payload
-	//
-	RtlCopyMemory((buffer + sizeof(Address)), Data, length - sizeof(Address));
+  Routine Description:
+
+	This routine copies the transfer statistics. Each counter is read
+	atomically; the copy as a whole is not a consistent snapshot.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Statistics - Receives the statistics
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SM5714_SPB_STATISTICS* source = &SpbContext->Statistics;
+	ULONG i;
 
-#if I2C_VERBOSE_LOGGING
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CWRITE: LENGTH=%d", length);
-	for (ULONG j = 0; j < length; j++)
+	Statistics->Transfers = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Transfers);
+	Statistics->Bytes = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Bytes);
+	Statistics->Errors = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Errors);
+	Statistics->Timeouts = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Timeouts);
+	Statistics->BusTimeUs = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->BusTimeUs);
+
+	for (i = 0; i < SM5714_SPB_LATENCY_BUCKETS; i++)
 	{
-		UCHAR byte = *(buffer + j);
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
+		Statistics->LatencyBuckets[i] = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->LatencyBuckets[i]);
 	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
+}
 
-	status = WdfIoTargetSendWriteSynchronously(
-		SpbContext->SpbIoTarget,
-		NULL,
-		&memoryDescriptor,
-		NULL,
-		NULL,
-		NULL);
+BOOLEAN
+SpbShouldRetry(
+	_In_                        NTSTATUS Status,
+	_In_                        ULONG Attempt
+)
+/*++
 
-	if (!NT_SUCCESS(status))
+  Routine Description:
+
+	This helper routine decides whether a failed transfer is retried.
+	Only bus protocol errors and address NACKs are considered transient;
+	timeouts are not, since a wedged bus would multiply the deadline.
+	Before returning TRUE it waits out the backoff of the attempt, which
+	doubles from SPB_RETRY_BACKOFF_US up to SPB_RETRY_BACKOFF_MAX_US.
+
+  Arguments:
+
+	Status     - The status of the failed attempt
+	Attempt    - The zero-based number of the failed attempt
+
+  Return Value:
+
+	TRUE if the transfer should be sent again
+
+--*/
+{
+	LARGE_INTEGER interval;
+	ULONG backoffUs;
+
+	if (NT_SUCCESS(Status) ||
+		Attempt + 1 >= SPB_TRANSFER_MAX_ATTEMPTS)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SM5714_BATTERY_ERROR,
-			"Error writing to Spb - 0x%08lX",
-			status);
-		goto exit;
+		return FALSE;
 	}
 
-exit:
+	if (Status != STATUS_DEVICE_PROTOCOL_ERROR &&
+		Status != STATUS_NO_SUCH_DEVICE)
+	{
+		return FALSE;
+	}
 
-	if (NULL != memory)
+	backoffUs = SPB_RETRY_BACKOFF_US << Attempt;
+	if (backoffUs > SPB_RETRY_BACKOFF_MAX_US)
 	{
-		WdfObjectDelete(memory);
+		backoffUs = SPB_RETRY_BACKOFF_MAX_US;
 	}
 
-	return status;
+	Trace(
+		TRACE_LEVEL_WARNING,
+		SM5714_BATTERY_WARN,
+		"Spb transfer attempt %lu failed status:%!STATUS!, retrying in %lu us",
+		Attempt + 1,
+		Status,
+		backoffUs);
+
+	interval.QuadPart = RELATIVE(MICROSECONDS(backoffUs));
+	KeDelayExecutionThread(KernelMode, FALSE, &interval);
+
+	return TRUE;
 }
 
 NTSTATUS
-SpbWriteDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	IN PVOID Data,
-	IN ULONG Length
+SpbAcquireSynchronousRequest(
+	_In_                        SPB_CONTEXT* SpbContext,
+	_Out_                       SPB_REQUEST_SLOT** Slot
 )
 /*++
 
   Routine Description:
 
-	This routine abstracts creating and sending an I/O
-	request (I2C Write) to the Spb I/O target and utilizes
-	a helper routine to do work inside of locked code.
+	This helper routine takes a request from the pool and readies it for
+	a synchronous send, so the framework does not allocate one per call.
 
   Arguments:
 
 	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to write to
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
+	Slot       - Receives the slot to pass to SpbReleaseRequestSlot
 
   Return Value:
 
@@ -181,41 +451,50 @@ SpbWriteDataSynchronously(
 
 --*/
 {
+	WDF_REQUEST_REUSE_PARAMS reuseParams;
+	SPB_REQUEST_SLOT* slot;
 	NTSTATUS status;
 
-	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	*Slot = NULL;
 
-	status = SpbDoWriteDataSynchronously(
-		SpbContext,
-		Address,
-		Data,
-		Length);
+	slot = SpbAcquireRequestSlot(SpbContext);
 
-	WdfWaitLockRelease(SpbContext->SpbLock);
+	WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+	status = WdfRequestReuse(slot->Request, &reuseParams);
 
-	return status;
+	if (!NT_SUCCESS(status))
+	{
+		SpbReleaseRequestSlot(slot);
+		return status;
+	}
+
+	WdfRequestSetCompletionRoutine(slot->Request, NULL, NULL);
+
+	*Slot = slot;
+	return STATUS_SUCCESS;
 }
 
 NTSTATUS
-SpbReadDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	_In_reads_bytes_(Length) PVOID Data,
-	IN ULONG Length
+SpbAllocateTransferBuffer(
+	_In_                        SPB_CONTEXT* SpbContext,
+	_In_                        ULONG Length,
+	_Out_                       WDFMEMORY* Memory,
+	_Out_                       PUCHAR* Buffer
 )
 /*++
 
   Routine Description:
 
-	This helper routine abstracts creating and sending an I/O
-	request (I2C Read) to the Spb I/O target.
+	This helper routine provides a buffer for a transfer that does not
+	fit the default buffers. Buffers come from the lookaside list, only
+	transfers beyond LARGE_SPB_BUFFER_SIZE fall back to pool.
 
   Arguments:
 
 	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to read from
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
+	Length     - The size of the transfer
+	Memory     - Receives the memory object, to be deleted by the caller
+	Buffer     - Receives the buffer of the memory object
 
   Return Value:
 
@@ -223,23 +502,289 @@ SpbReadDataSynchronously(
 
 --*/
 {
-	PUCHAR buffer;
-	WDFMEMORY memory;
-	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
 	NTSTATUS status;
-	ULONG_PTR bytesRead;
 
-	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	if (Length <= LARGE_SPB_BUFFER_SIZE)
+	{
+		status = WdfMemoryCreateFromLookaside(
+			SpbContext->LargeBufferLookaside,
+			Memory);
 
-	memory = NULL;
-	status = STATUS_INVALID_PARAMETER;
-	bytesRead = 0;
+		if (NT_SUCCESS(status))
+		{
+			*Buffer = (PUCHAR)WdfMemoryGetBuffer(*Memory, NULL);
+		}
+	}
+	else
+	{
+		SPB_COUNT_ALLOCATION(SpbContext);
 
-	//
-	// Read transactions start by writing an address pointer
-	//
-	status = SpbDoWriteDataSynchronously(
-		SpbContext,
+		status = WdfMemoryCreate(
+			WDF_NO_OBJECT_ATTRIBUTES,
+			NonPagedPoolNx,
+			SPB_POOL_TAG,
+			Length,
+			Memory,
+			(PVOID*)Buffer);
+	}
+
+	return status;
+}
+
+NTSTATUS
+SpbDoWriteDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	IN PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This helper routine abstracts creating and sending an I/O
+	request (I2C Write) to the Spb I/O target.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to write to
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	PUCHAR buffer;
+	ULONG length;
+	WDFMEMORY memory;
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	SPB_REQUEST_SLOT* slot;
+	ULONGLONG startTime;
+	LARGE_INTEGER busStart;
+	ULONG_PTR bytesWritten;
+	NTSTATUS status;
+
+	startTime = SpbTraceStart();
+	bytesWritten = 0;
+
+	//
+	// The address pointer and data buffer must be combined
+	// into one contiguous buffer representing the write transaction.
+	//
+	length = Length + 1;
+	memory = NULL;
+	slot = NULL;
+
+	SPB_COUNT_TRANSFER(SpbContext);
+
+	if (length > DEFAULT_SPB_BUFFER_SIZE)
+	{
+		status = SpbAllocateTransferBuffer(
+			SpbContext,
+			length,
+			&memory,
+			&buffer);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SM5714_BATTERY_ERROR,
+				"Error allocating memory for Spb write - 0x%08lX",
+				status);
+			goto exit;
+		}
+
+	}
+	else
+	{
+		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->WriteMemory, NULL);
+	}
+
+	//
+	// Lookaside buffers may be larger than the transfer, so always
+	// describe exactly the bytes to send
+	//
+	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+		&memoryDescriptor,
+		(PVOID)buffer,
+		length);
+
+	//
+	// Transaction starts by specifying the address bytes
+	//
+	RtlCopyMemory(buffer, &Address, sizeof(Address));
+
+	//
+	// Address is followed by the data payload
+	//
+	RtlCopyMemory((buffer + sizeof(Address)), Data, length - sizeof(Address));
+
+	status = SpbAcquireSynchronousRequest(SpbContext, &slot);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+	sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(SPB_TRANSFER_TIMEOUT_US);
+
+	busStart = SpbStatisticsStart();
+
+	status = WdfIoTargetSendWriteSynchronously(
+		SpbContext->SpbIoTarget,
+		slot->Request,
+		&memoryDescriptor,
+		NULL,
+		&sendOptions,
+		&bytesWritten);
+
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytesWritten, status);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Error writing to Spb - 0x%08lX",
+			status);
+		goto exit;
+	}
+
+exit:
+
+	if (NULL != slot)
+	{
+		SpbReleaseRequestSlot(slot);
+	}
+
+	if (NULL != memory)
+	{
+		WdfObjectDelete(memory);
+	}
+
+	SpbTraceTransaction(
+		SpbContext,
+		SM5714_I2C_TRACE_WRITE,
+		Address,
+		Data,
+		Length,
+		NULL,
+		0,
+		status,
+		startTime);
+
+	return status;
+}
+
+NTSTATUS
+SpbWriteDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	IN PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This routine abstracts creating and sending an I/O
+	request (I2C Write) to the Spb I/O target and utilizes
+	a helper routine to do work inside of locked code.
+	Transient bus errors are retried as described by SpbShouldRetry.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to write to
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	ULONG attempt;
+
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+
+	for (attempt = 0; ; attempt++)
+	{
+		status = SpbDoWriteDataSynchronously(
+			SpbContext,
+			Address,
+			Data,
+			Length);
+
+		if (!SpbShouldRetry(status, attempt))
+		{
+			break;
+		}
+	}
+
+	WdfWaitLockRelease(SpbContext->SpbLock);
+
+	return status;
+}
+
+NTSTATUS
+SpbDoReadDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_bytes_(Length) PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This helper routine abstracts creating and sending an I/O
+	request (I2C Read) to the Spb I/O target.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to read from
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	PUCHAR buffer;
+	WDFMEMORY memory;
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	SPB_REQUEST_SLOT* slot;
+	ULONGLONG startTime;
+	LARGE_INTEGER busStart;
+	NTSTATUS status;
+	ULONG_PTR bytesRead;
+
+	startTime = SpbTraceStart();
+	buffer = NULL;
+	memory = NULL;
+	slot = NULL;
+	status = STATUS_INVALID_PARAMETER;
+	bytesRead = 0;
+
+	//
+	// Read transactions start by writing an address pointer
+	//
+	status = SpbDoWriteDataSynchronously(
+		SpbContext,
 		Address,
 		NULL,
 		0);
@@ -254,12 +799,12 @@ SpbReadDataSynchronously(
 		goto exit;
 	}
 
+	SPB_COUNT_TRANSFER(SpbContext);
+
 	if (Length > DEFAULT_SPB_BUFFER_SIZE)
 	{
-		status = WdfMemoryCreate(
-			WDF_NO_OBJECT_ATTRIBUTES,
-			NonPagedPool,
-			SPB_POOL_TAG,
+		status = SpbAllocateTransferBuffer(
+			SpbContext,
 			Length,
 			&memory,
 			&buffer);
@@ -273,321 +818,1461 @@ SpbReadDataSynchronously(
 				status);
 			goto exit;
 		}
-
-		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
-			&memoryDescriptor,
-			memory,
-			NULL);
 	}
 	else
 	{
 		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->ReadMemory, NULL);
+	}
 
-		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
-			&memoryDescriptor,
-			(PVOID)buffer,
-			Length);
+	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+		&memoryDescriptor,
+		(PVOID)buffer,
+		Length);
+
+	status = SpbAcquireSynchronousRequest(SpbContext, &slot);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
 	}
 
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+	sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(SPB_TRANSFER_TIMEOUT_US);
+
+	busStart = SpbStatisticsStart();
 
 	status = WdfIoTargetSendReadSynchronously(
 		SpbContext->SpbIoTarget,
-		NULL,
+		slot->Request,
 		&memoryDescriptor,
 		NULL,
-		NULL,
+		&sendOptions,
 		&bytesRead);
 
-	if (!NT_SUCCESS(status) ||
-		bytesRead != Length)
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytesRead, status);
+
+	//
+	// A short read means the device NACKed part of the transfer
+	//
+	if (NT_SUCCESS(status) && bytesRead != Length)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Error reading from Spb - 0x%08lX",
+			status);
+		goto exit;
+	}
+
+	//
+	// Copy back to the caller's buffer
+	//
+	RtlCopyMemory(Data, buffer, Length);
+
+exit:
+	SpbTraceTransaction(
+		SpbContext,
+		SM5714_I2C_TRACE_READ,
+		Address,
+		NULL,
+		0,
+		buffer,
+		Length,
+		status,
+		startTime);
+
+	if (NULL != slot)
+	{
+		SpbReleaseRequestSlot(slot);
+	}
+
+	if (NULL != memory)
+	{
+		WdfObjectDelete(memory);
+	}
+
+	return status;
+}
+
+NTSTATUS
+SpbReadDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_bytes_(Length) PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This routine abstracts creating and sending an I/O
+	request (I2C Read) to the Spb I/O target and utilizes
+	a helper routine to do work inside of locked code.
+	Transient bus errors are retried as described by SpbShouldRetry.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to read from
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	ULONG attempt;
+
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+
+	for (attempt = 0; ; attempt++)
+	{
+		status = SpbDoReadDataSynchronously(
+			SpbContext,
+			Address,
+			Data,
+			Length);
+
+		if (!SpbShouldRetry(status, attempt))
+		{
+			break;
+		}
+	}
+
+	WdfWaitLockRelease(SpbContext->SpbLock);
+
+	return status;
+}
+
+//
+// Largest sequence any caller builds: a combined SRAM read batch with
+// three entries per word in the split layout. Every pool slot carries a
+// sequence buffer of this size.
+//
+#define SPB_MAX_SEQUENCE_ENTRIES (SPB_MAX_COMBINED_READS * 3)
+#define SPB_MAX_SEQUENCE_SIZE \
+	(FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) + SPB_MAX_SEQUENCE_ENTRIES * sizeof(SPB_TRANSFER_LIST_ENTRY))
+
+C_ASSERT(SPB_REQUEST_POOL_SIZE <= 31);
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE SpbEvtSequenceCompletion;
+
+typedef struct _SPB_SYNC_CONTEXT
+{
+	KEVENT Event;
+	NTSTATUS Status;
+	ULONG BytesReturned;
+} SPB_SYNC_CONTEXT;
+
+NTSTATUS
+SpbRequestPoolInitialize(
+	_In_                        SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+	This routine creates the preallocated requests and sequence buffers
+	used for every sequence transfer. They are parented to the I/O target
+	and reused until it goes away.
+  Arguments:
+	SpbContext      - Pointer to the current device context
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	SPB_REQUEST_SLOT* slot;
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG i;
+
+	SpbContext->RequestFreeMask = 0;
+
+	for (i = 0; i < SPB_REQUEST_POOL_SIZE; i++)
+	{
+		slot = &SpbContext->RequestPool[i];
+		slot->SpbContext = SpbContext;
+		slot->Index = i;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = SpbContext->SpbIoTarget;
+
+		status = WdfRequestCreate(
+			&attributes,
+			SpbContext->SpbIoTarget,
+			&slot->Request);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SM5714_BATTERY_ERROR,
+				"Error creating Spb request %lu - 0x%08lX",
+				i,
+				status);
+			goto exit;
+		}
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = slot->Request;
+
+		status = WdfMemoryCreate(
+			&attributes,
+			NonPagedPoolNx,
+			SPB_POOL_TAG,
+			SPB_MAX_SEQUENCE_SIZE,
+			&slot->SequenceMemory,
+			NULL);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SM5714_BATTERY_ERROR,
+				"Error allocating Spb sequence memory %lu - 0x%08lX",
+				i,
+				status);
+			goto exit;
+		}
+
+		SpbContext->RequestFreeMask |= (1 << i);
+	}
+
+exit:
+
+	KeInitializeSemaphore(
+		&SpbContext->RequestPoolSemaphore,
+		RtlNumberOfSetBits((ULONG)SpbContext->RequestFreeMask),
+		SPB_REQUEST_POOL_SIZE);
+
+	return status;
+}
+
+SPB_REQUEST_SLOT*
+SpbAcquireRequestSlot(
+	_In_                        SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+	This routine takes a free slot out of the request pool, waiting for
+	one to be returned if all are in use.
+  Arguments:
+	SpbContext      - Pointer to the current device context
+  Return Value:
+	The claimed slot
+--*/
+{
+	LONG mask;
+	ULONG index;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	KeWaitForSingleObject(
+		&SpbContext->RequestPoolSemaphore,
+		Executive,
+		KernelMode,
+		FALSE,
+		NULL);
+
+	//
+	// The semaphore guarantees a set bit, claim it
+	//
+	for (;;)
+	{
+		mask = SpbContext->RequestFreeMask;
+		NT_ASSERT(mask != 0);
+		_BitScanForward(&index, (ULONG)mask);
+
+		if (InterlockedCompareExchange(
+				&SpbContext->RequestFreeMask,
+				mask & ~(1 << index),
+				mask) == mask)
+		{
+			return &SpbContext->RequestPool[index];
+		}
+	}
+}
+
+VOID
+SpbReleaseRequestSlot(
+	_In_                        SPB_REQUEST_SLOT* Slot
+)
+/*++
+
+  Routine Description:
+	This routine returns a slot to the request pool.
+  Arguments:
+	Slot            - The slot taken by SpbAcquireRequestSlot
+  Return Value:
+	None
+--*/
+{
+	SPB_CONTEXT* spbContext = Slot->SpbContext;
+
+	InterlockedOr(&spbContext->RequestFreeMask, (1 << Slot->Index));
+	KeReleaseSemaphore(&spbContext->RequestPoolSemaphore, IO_NO_INCREMENT, 1, FALSE);
+}
+
+VOID
+SpbEvtSequenceCompletion(
+	_In_                        WDFREQUEST Request,
+	_In_                        WDFIOTARGET Target,
+	_In_                        PWDF_REQUEST_COMPLETION_PARAMS Params,
+	_In_                        WDFCONTEXT Context
+)
+/*++
+
+  Routine Description:
+	This routine completes an asynchronous sequence: it hands the result
+	to the caller's completion and then returns the request to the pool.
+  Arguments:
+	Request         - The pool request that completed
+	Target          - The SPB I/O target
+	Params          - The completion parameters
+	Context         - The pool slot of the request
+  Return Value:
+	None
+--*/
+{
+	SPB_REQUEST_SLOT* slot = (SPB_REQUEST_SLOT*)Context;
+	PFN_SPB_SEQUENCE_COMPLETION completion = slot->Completion;
+	PVOID completionContext = slot->CompletionContext;
+	NTSTATUS status = Params->IoStatus.Status;
+	ULONG bytes = (ULONG)Params->IoStatus.Information;
+
+	UNREFERENCED_PARAMETER(Request);
+	UNREFERENCED_PARAMETER(Target);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Failed sending SPB Sequence IOCTL bytes:%lu status:%!STATUS!",
+			bytes,
+			status);
+	}
+
+	//
+	// Return the slot only after the caller has consumed the result, so
+	// the request and its sequence memory cannot be reused underneath it.
+	//
+	completion(status, bytes, completionContext);
+	SpbReleaseRequestSlot(slot);
+}
+
+NTSTATUS
+SpbSequenceAsync(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_bytes_(SequenceLength) PVOID          Sequence,
+	_In_                            SIZE_T          SequenceLength,
+	_In_                            ULONG           TimeoutUs,
+	_In_                            PFN_SPB_SEQUENCE_COMPLETION Completion,
+	_In_opt_                        PVOID           Context
+)
+/*++
+
+  Routine Description:
+	This routine sends a sequence request to the SPB I/O target without
+	waiting for it. The transfer list is copied into a preallocated pool
+	request, so the caller's list may live on its stack; the buffers the
+	list points to must stay valid until Completion runs.
+  Arguments:
+	SpbContext      - Pointer to the current device context
+	Sequence        - Pointer to a list of sequence transfers
+	SequenceLength  - Length of sequence transfers
+	TimeoutUs       - The timeout associated with this transfer in
+						microseconds, 0 means no timeout
+	Completion      - Called with the result unless this routine fails
+	Context         - Passed to Completion
+  Return Value:
+	NTSTATUS Status indicating whether the request was sent. On failure
+	Completion is not called.
+--*/
+{
+	WDF_REQUEST_REUSE_PARAMS reuseParams;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	WDFMEMORY_OFFSET sequenceOffset;
+	SPB_REQUEST_SLOT* slot;
+	NTSTATUS status;
+
+	if (SequenceLength > SPB_MAX_SEQUENCE_SIZE)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Spb sequence of %Iu bytes exceeds the pool buffer status:%!STATUS!",
+			SequenceLength,
+			status);
+		return status;
+	}
+
+	slot = SpbAcquireRequestSlot(SpbContext);
+
+	WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+	status = WdfRequestReuse(slot->Request, &reuseParams);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = WdfMemoryCopyFromBuffer(slot->SequenceMemory, 0, Sequence, SequenceLength);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	sequenceOffset.BufferOffset = 0;
+	sequenceOffset.BufferLength = SequenceLength;
+
+	status = WdfIoTargetFormatRequestForIoctl(
+		SpbContext->SpbIoTarget,
+		slot->Request,
+		IOCTL_SPB_EXECUTE_SEQUENCE,
+		slot->SequenceMemory,
+		&sequenceOffset,
+		NULL,
+		NULL);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"WdfIoTargetFormatRequestForIoctl failed status:%!STATUS!",
+			status);
+		goto exit;
+	}
+
+	slot->Completion = Completion;
+	slot->CompletionContext = Context;
+	WdfRequestSetCompletionRoutine(slot->Request, SpbEvtSequenceCompletion, slot);
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, 0);
+	if (TimeoutUs != 0)
+	{
+		WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&sendOptions, WDF_REL_TIMEOUT_IN_US(TimeoutUs));
+	}
+
+	if (!WdfRequestSend(slot->Request, SpbContext->SpbIoTarget, &sendOptions))
+	{
+		status = WdfRequestGetStatus(slot->Request);
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"WdfRequestSend failed status:%!STATUS!",
+			status);
+		goto exit;
+	}
+
+	//
+	// The completion routine owns the slot from here on
+	//
+	return STATUS_SUCCESS;
+
+exit:
+
+	SpbReleaseRequestSlot(slot);
+	return status;
+}
+
+VOID
+SpbSyncSequenceCompletion(
+	_In_                        NTSTATUS Status,
+	_In_                        ULONG BytesReturned,
+	_In_opt_                    PVOID Context
+)
+{
+	SPB_SYNC_CONTEXT* syncContext = (SPB_SYNC_CONTEXT*)Context;
+
+	syncContext->Status = Status;
+	syncContext->BytesReturned = BytesReturned;
+	KeSetEvent(&syncContext->Event, IO_NO_INCREMENT, FALSE);
+}
+
+NTSTATUS
+_SpbSequence(
+	_In_                        SPB_CONTEXT* SpbContext,
+	_In_reads_(SequenceLength)  PVOID        Sequence,
+	_In_                        SIZE_T       SequenceLength,
+	_Out_                       PULONG       BytesReturned,
+	_In_                        ULONG        TimeoutUs
+)
+/*++
+
+  Routine Description:
+	This routine forwards a sequence request to the SPB I/O target and
+	waits for it, using a request from the pool. Transient bus errors are
+	retried as described by SpbShouldRetry.
+  Arguments:
+	SpbContext      - Pointer to the current device context
+	Sequence        - Pointer to a list of sequence transfers
+	SequenceLength  - Length of sequence transfers
+	BytesReturned   - The number of bytes transferred in the actual transaction
+	TimeoutUs       - The timeout of each attempt in microseconds,
+						0 means no timeout
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	SPB_SYNC_CONTEXT syncContext;
+	LARGE_INTEGER busStart;
+	NTSTATUS status;
+	ULONG attempt;
+
+	*BytesReturned = 0;
+
+	for (attempt = 0; ; attempt++)
+	{
+		SPB_COUNT_TRANSFER(SpbContext);
+
+		KeInitializeEvent(&syncContext.Event, NotificationEvent, FALSE);
+		syncContext.Status = STATUS_UNSUCCESSFUL;
+		syncContext.BytesReturned = 0;
+		busStart = SpbStatisticsStart();
+
+		status = SpbSequenceAsync(
+			SpbContext,
+			Sequence,
+			SequenceLength,
+			TimeoutUs,
+			SpbSyncSequenceCompletion,
+			&syncContext);
+
+		if (NT_SUCCESS(status))
+		{
+			KeWaitForSingleObject(&syncContext.Event, Executive, KernelMode, FALSE, NULL);
+			status = syncContext.Status;
+		}
+
+		SpbStatisticsRecord(SpbContext, busStart, syncContext.BytesReturned, status);
+
+		if (!SpbShouldRetry(status, attempt))
+		{
+			break;
+		}
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	//
+	// Copy the number of bytes transmitted over the bus
+	// The controller needs to support querying for actual bytes
+	// for each transaction
+	//
+
+	*BytesReturned = syncContext.BytesReturned;
+
+exit:
+
+	return status;
+}
+
+NTSTATUS
+SpbWriteRead(
+	_In_                            SPB_CONTEXT* SpbContext,
+	_In_reads_(SendLength)          PVOID           SendData,
+	_In_                            USHORT          SendLength,
+	_In_reads_(CmdLength)			PVOID			ReadCmd,
+	_In_							USHORT			CmdLength,
+	_Out_writes_(DataLength)        PVOID           Data,
+	_In_                            USHORT          DataLength,
+	_In_                            ULONG           DelayUs
+)
+/*++
+
+  Routine Description:
+	This routine forwards a write-read sequence to the SPB I/O target.
+	In the compacted layout both writes go out as one ToDevice buffer
+	list entry, saving an address phase and a restart.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	SendData                The first byte buffer containing the data
+	SendLength              The length of the first byte buffer data
+	ReadCmd                 The second write, selecting the data to read
+	CmdLength               The length of the second write
+	Data                    The buffer receiving the data
+	DataLength              The length of the data to read
+	DelayUs                 The delay between calls
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	ULONGLONG startTime;
+	SPB_TRANSFER_BUFFER_LIST_ENTRY writeBuffers[2];
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	startTime = SpbTraceStart();
+
+	//
+	// Build the SPB sequence
+	//
+	SPB_TRANSFER_LIST_AND_ENTRIES(3)    sequence;
+
+	{
+		//
+		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+		// "struct hack" size but using an index variable quiets 
+		// the warning. This is a false positive from OACR.
+		// 
+
+		ULONG index = 0;
+
+		if (SpbContext->SramCompactReads)
+		{
+			//
+			// Compact the adjacent writes of the two register accesses into a 
+			// single write transfer list entry without restarts between them.
+			//
+			writeBuffers[0].Buffer = SendData;
+			writeBuffers[0].BufferCb = SendLength;
+			writeBuffers[1].Buffer = ReadCmd;
+			writeBuffers[1].BufferCb = CmdLength;
+
+			sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_BUFFER_LIST(
+				SpbTransferDirectionToDevice,
+				0,
+				writeBuffers,
+				ARRAYSIZE(writeBuffers));
+
+			index += 1;
+		}
+		else
+		{
+			sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+				SpbTransferDirectionToDevice,
+				0,
+				SendData,
+				SendLength);
+
+			sequence.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+				SpbTransferDirectionToDevice,
+				0,
+				ReadCmd,
+				CmdLength);
+
+			index += 2;
+		}
+
+		sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			DelayUs,
+			Data,
+			DataLength);
+
+		SPB_TRANSFER_LIST_INIT(&(sequence.List), index + 1);
+	}
+
+	//
+	// Send the read as a Sequence request to the SPB target
+	// 
+	ULONG bytesReturned = 0;
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"SpbSequence failed sending a sequence "
+			"status:%!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Check if this is a "short transaction" i.e. the sequence
+	// resulted in lesser bytes transmitted/received than expected
+	//
+	ULONG expectedLength = SendLength + DataLength;
+	if (bytesReturned < expectedLength)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"SpbSequence returned with 0x%lu bytes expected:0x%lu bytes "
+			"status:%!STATUS!",
+			bytesReturned,
+			expectedLength,
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	SpbTraceTransaction(
+		SpbContext,
+		SM5714_I2C_TRACE_WRITE_READ,
+		(SendLength > 1) ? ((PUCHAR)SendData)[1] : 0,
+		SendData,
+		SendLength,
+		Data,
+		DataLength,
+		status,
+		startTime);
+
+	return status;
+}
+
+NTSTATUS
+SpbDoReadSramWords(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Addresses,
+	_Out_writes_(Count)             PUSHORT         Words,
+	_In_                            ULONG           Count,
+	_In_                            ULONG           DelayUs
+)
+/*++
+
+  Routine Description:
+	This routine reads several fuel gauge SRAM words in a single
+	IOCTL_SPB_EXECUTE_SEQUENCE request. Every word is fetched with the
+	same RADDR write, RDATA write, read triple that SpbWriteRead uses,
+	but all triples share one sequence, one pooled request and one
+	bus turnaround. In the compacted layout the two writes of every
+	word share one ToDevice buffer list entry.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Addresses               The SRAM addresses to read
+	Words                   Receives the raw SRAM word of each address
+	Count                   The number of addresses, at most SPB_MAX_COMBINED_READS
+	DelayUs                 The delay before each read transfer
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	UCHAR addressWrites[SPB_MAX_COMBINED_READS][3];
+	SPB_TRANSFER_BUFFER_LIST_ENTRY writeBuffers[SPB_MAX_COMBINED_READS][2];
+	ULONGLONG startTime;
+	ULONG entriesPerWord;
+	ULONG i;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	startTime = SpbTraceStart();
+
+	if (Addresses == NULL || Words == NULL ||
+		Count == 0 || Count > SPB_MAX_COMBINED_READS)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"SpbDoReadSramWords failed parameters Addresses:%p Words:%p Count:%lu "
+			"status:%!STATUS!",
+			Addresses,
+			Words,
+			Count,
+			status);
+
+		return status;
+	}
+
+	//
+	// Build the SPB sequence
+	//
+	entriesPerWord = SpbContext->SramCompactReads ? 2 : 3;
+
+	SPB_TRANSFER_LIST_AND_ENTRIES(SPB_MAX_COMBINED_READS * 3)    sequence;
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), Count * entriesPerWord);
+
+	for (i = 0; i < Count; i++)
+	{
+		//
+		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+		// "struct hack" size but using an index variable quiets
+		// the warning. This is a false positive from OACR.
+		//
+
+		ULONG index = i * entriesPerWord;
+
+		addressWrites[i][0] = (UCHAR)SM5714_FG_REG_SRAM_RADDR;
+		addressWrites[i][1] = Addresses[i];
+		addressWrites[i][2] = 0;
+
+		if (SpbContext->SramCompactReads)
+		{
+			writeBuffers[i][0].Buffer = addressWrites[i];
+			writeBuffers[i][0].BufferCb = sizeof(addressWrites[i]);
+			writeBuffers[i][1].Buffer = &readCmd;
+			writeBuffers[i][1].BufferCb = sizeof(readCmd);
+
+			sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_BUFFER_LIST(
+				SpbTransferDirectionToDevice,
+				0,
+				writeBuffers[i],
+				ARRAYSIZE(writeBuffers[i]));
+		}
+		else
+		{
+			sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+				SpbTransferDirectionToDevice,
+				0,
+				addressWrites[i],
+				sizeof(addressWrites[i]));
+
+			sequence.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+				SpbTransferDirectionToDevice,
+				0,
+				&readCmd,
+				sizeof(readCmd));
+		}
+
+		sequence.List.Transfers[index + entriesPerWord - 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			DelayUs,
+			&Words[i],
+			sizeof(USHORT));
+	}
+
+	//
+	// Send the reads as one Sequence request to the SPB target
+	//
+	ULONG bytesReturned = 0;
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"SpbSequence failed sending a sequence "
+			"status:%!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Check if this is a "short transaction" i.e. the sequence
+	// resulted in lesser bytes transmitted/received than expected
+	//
+	ULONG expectedLength = Count * (sizeof(addressWrites[0]) + sizeof(USHORT));
+	if (bytesReturned < expectedLength)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"SpbSequence returned with 0x%lu bytes expected:0x%lu bytes "
+			"status:%!STATUS!",
+			bytesReturned,
+			expectedLength,
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	SpbTraceTransaction(
+		SpbContext,
+		SM5714_I2C_TRACE_SRAM_READ,
+		Addresses[0],
+		Addresses,
+		Count,
+		Words,
+		Count * sizeof(USHORT),
+		status,
+		startTime);
+
+	return status;
+}
+
+VOID
+SpbRunSramReadBatch(
+	_In_                            SPB_CONTEXT*    SpbContext
+)
+/*++
+
+  Routine Description:
+	This routine is run by the current owner of the submission queue. It
+	takes the oldest queued submissions up to SPB_MAX_COMBINED_READS words,
+	reads them with one SpbDoReadSramWords sequence and completes each
+	submission from its part of the result. Ownership then passes to the
+	oldest submission still queued, or the queue goes idle.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+  Return Value:
+	None
+--*/
+{
+	NTSTATUS status;
+	LIST_ENTRY batch;
+	PLIST_ENTRY entry;
+	SPB_READ_SUBMISSION* submission;
+	UCHAR addresses[SPB_MAX_COMBINED_READS];
+	USHORT words[SPB_MAX_COMBINED_READS];
+	ULONG submissions;
+	ULONG delayUs;
+	ULONG count;
+
+	InitializeListHead(&batch);
+	submissions = 0;
+	delayUs = 0;
+	count = 0;
+
+	WdfWaitLockAcquire(SpbContext->SubmissionLock, NULL);
+
+	while (!IsListEmpty(&SpbContext->SubmissionQueue))
+	{
+		submission = CONTAINING_RECORD(
+			SpbContext->SubmissionQueue.Flink,
+			SPB_READ_SUBMISSION,
+			ListEntry);
+
+		if (count + submission->Count > SPB_MAX_COMBINED_READS)
+		{
+			break;
+		}
+
+		RemoveEntryList(&submission->ListEntry);
+		InsertTailList(&batch, &submission->ListEntry);
+
+		RtlCopyMemory(&addresses[count], submission->Addresses, submission->Count);
+		count += submission->Count;
+
+		if (submission->DelayUs > delayUs)
+		{
+			delayUs = submission->DelayUs;
+		}
+
+		submissions++;
+	}
+
+	WdfWaitLockRelease(SpbContext->SubmissionLock);
+
+	//
+	// The owner's own submission is at the head of the queue, so the batch
+	// is never empty
+	//
+	NT_ASSERT(count != 0);
+
+	status = SpbDoReadSramWords(SpbContext, addresses, words, count, delayUs);
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		SM5714_BATTERY_INFO,
+		"Combined %lu SRAM read submissions into %lu words "
+		"status:%!STATUS!",
+		submissions,
+		count,
+		status);
+
+	//
+	// A submission belongs to its waiting caller again as soon as Done is
+	// set, so nothing may touch it afterwards
+	//
+	count = 0;
+
+	while (!IsListEmpty(&batch))
+	{
+		entry = RemoveHeadList(&batch);
+		submission = CONTAINING_RECORD(entry, SPB_READ_SUBMISSION, ListEntry);
+
+		if (NT_SUCCESS(status))
+		{
+			RtlCopyMemory(submission->Words, &words[count], submission->Count * sizeof(USHORT));
+		}
+
+		count += submission->Count;
+		submission->Status = status;
+		KeSetEvent(&submission->Done, IO_NO_INCREMENT, FALSE);
+	}
+
+	WdfWaitLockAcquire(SpbContext->SubmissionLock, NULL);
+
+	if (IsListEmpty(&SpbContext->SubmissionQueue))
+	{
+		SpbContext->SubmissionActive = FALSE;
+	}
+	else
+	{
+		submission = CONTAINING_RECORD(
+			SpbContext->SubmissionQueue.Flink,
+			SPB_READ_SUBMISSION,
+			ListEntry);
+
+		submission->Promoted = TRUE;
+		KeSetEvent(&submission->Done, IO_NO_INCREMENT, FALSE);
+	}
+
+	WdfWaitLockRelease(SpbContext->SubmissionLock);
+}
+
+NTSTATUS
+SpbReadSramWords(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Addresses,
+	_Out_writes_(Count)             PUSHORT         Words,
+	_In_                            ULONG           Count,
+	_In_                            ULONG           DelayUs
+)
+/*++
+
+  Routine Description:
+	This routine reads several fuel gauge SRAM words through the
+	submission queue. Reads queued by concurrent callers are combined
+	into one sequence, so a burst of callers costs one SPB request
+	instead of one each. The first caller to find the queue idle sends
+	the batch; the others wait until their words are in or until they
+	are promoted to send the next batch.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Addresses               The SRAM addresses to read
+	Words                   Receives the raw SRAM word of each address
+	Count                   The number of addresses, at most SPB_MAX_SRAM_READS
+	DelayUs                 The delay before each read transfer
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	SPB_READ_SUBMISSION submission;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	if (Addresses == NULL || Words == NULL ||
+		Count == 0 || Count > SPB_MAX_SRAM_READS)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	submission.Addresses = Addresses;
+	submission.Words = Words;
+	submission.Count = Count;
+	submission.DelayUs = DelayUs;
+	submission.Status = STATUS_PENDING;
+	submission.Promoted = FALSE;
+	KeInitializeEvent(&submission.Done, NotificationEvent, FALSE);
+
+	WdfWaitLockAcquire(SpbContext->SubmissionLock, NULL);
+
+	InsertTailList(&SpbContext->SubmissionQueue, &submission.ListEntry);
+
+	if (!SpbContext->SubmissionActive)
+	{
+		SpbContext->SubmissionActive = TRUE;
+		submission.Promoted = TRUE;
+		KeSetEvent(&submission.Done, IO_NO_INCREMENT, FALSE);
+	}
+
+	WdfWaitLockRelease(SpbContext->SubmissionLock);
+
+	for (;;)
+	{
+		KeWaitForSingleObject(&submission.Done, Executive, KernelMode, FALSE, NULL);
+
+		if (!submission.Promoted)
+		{
+			break;
+		}
+
+		//
+		// This caller owns the queue now. Its submission is the oldest one
+		// queued and goes out with the batch, which sets Done again.
+		//
+		submission.Promoted = FALSE;
+		KeClearEvent(&submission.Done);
+
+		SpbRunSramReadBatch(SpbContext);
+	}
+
+	return submission.Status;
+}
+
+NTSTATUS
+SpbReadSramRange(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            UCHAR           StartAddress,
+	_Out_writes_(Count)             PUSHORT         Words,
+	_In_                            ULONG           Count
+)
+/*++
+
+  Routine Description:
+	This routine reads Count consecutive fuel gauge SRAM words starting
+	at StartAddress in one sequence request. When the part auto-increments
+	SRAM_RADDR the whole window is a single read transfer, otherwise the
+	sequence carries one RADDR/RDATA/read triple per word.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	StartAddress            The first SRAM address of the window
+	Words                   Receives the raw SRAM words of the window
+	Count                   The number of words, at most SPB_MAX_SRAM_READS
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	UCHAR addresses[SPB_MAX_SRAM_READS];
+	UCHAR addressWrite[3];
+	ULONG i;
+
+	if (Words == NULL || Count == 0 || Count > SPB_MAX_SRAM_READS)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		goto exit;
+	}
+
+	if (SpbContext->SramAutoIncrement)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SM5714_BATTERY_ERROR,
-			"Error reading from Spb - 0x%08lX",
-			status);
+		addressWrite[0] = (UCHAR)SM5714_FG_REG_SRAM_RADDR;
+		addressWrite[1] = StartAddress;
+		addressWrite[2] = 0;
+
+		status = SpbWriteRead(
+			SpbContext,
+			addressWrite,
+			sizeof(addressWrite),
+			&readCmd,
+			sizeof(readCmd),
+			Words,
+			(USHORT)(Count * sizeof(USHORT)),
+			0);
+
 		goto exit;
 	}
 
-#if I2C_VERBOSE_LOGGING
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CREAD: LENGTH=%d", Length);
-	for (ULONG j = 0; j < Length; j++)
+	for (i = 0; i < Count; i++)
 	{
-		UCHAR byte = *(buffer + j);
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
+		addresses[i] = (UCHAR)(StartAddress + i);
 	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
 
-	//
-	// Copy back to the caller's buffer
-	//
-	RtlCopyMemory(Data, buffer, Length);
+	status = SpbReadSramWords(SpbContext, addresses, Words, Count, 0);
 
 exit:
-	if (NULL != memory)
-	{
-		WdfObjectDelete(memory);
-	}
-
-	WdfWaitLockRelease(SpbContext->SpbLock);
 
 	return status;
 }
 
 NTSTATUS
-_SpbSequence(
-	_In_                        SPB_CONTEXT* SpbContext,
-	_In_reads_(SequenceLength)  PVOID        Sequence,
-	_In_                        SIZE_T       SequenceLength,
-	_Out_                       PULONG       BytesReturned,
-	_In_                        ULONG        Timeout
+SpbReadTelemetry(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           PSM5714_FG_TELEMETRY Telemetry
 )
 /*++
 
   Routine Description:
-	This routine forwards a sequence request to the SPB I/O target
+	This routine sweeps the SRAM telemetry window (SOC through CURRENT_AVG)
+	with a single SpbReadSramRange call and decodes every word.
   Arguments:
-	FxIoTarget      - The SPB IoTarget to which to send the IOCTL/Read/Write
-	Sequence        - Pointer to a list of sequence transfers
-	SequenceLength  - Length of sequence transfers
-	BytesReturned   - The number of bytes transferred in the actual transaction
-	Timeout         - The timeout associated with this transfer
-						Default is HIDI2C_REQUEST_DEFAULT_TIMEOUT second
-						0 means no timeout
+	SpbContext      -       Pointer to the current device context
+	Telemetry               Receives the raw and decoded telemetry
   Return Value:
 	NTSTATUS Status indicating success or failure
 --*/
 {
 	NTSTATUS status;
+	PUSHORT raw;
 
-	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
-
-	//
-	// Create preallocated WDFMEMORY.
-	//
-	WDFMEMORY memorySequence = NULL;
-
-	WDF_OBJECT_ATTRIBUTES attributes;
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	RtlZeroMemory(Telemetry, sizeof(*Telemetry));
+	raw = Telemetry->Raw;
 
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		Sequence,
-		SequenceLength,
-		&memorySequence);
+	status = SpbReadSramRange(
+		SpbContext,
+		SM5714_FG_SRAM_TELEMETRY_FIRST,
+		raw,
+		SM5714_FG_SRAM_TELEMETRY_COUNT);
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			SM5714_BATTERY_ERROR,
-			"WdfMemoryCreatePreallocated failed creating memory for sequence"
+			"SpbReadSramRange failed reading telemetry window "
 			"status:%!STATUS!",
 			status);
 
 		goto exit;
 	}
 
-	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
-	WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
-		&memoryDescriptor,
-		memorySequence,
-		NULL);
+	Telemetry->Soc = SM5714FgDecodeSoc(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_SOC)]);
+	Telemetry->OcvMv = SM5714FgDecodeVoltage(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_OCV)]);
+	Telemetry->VbatMv = SM5714FgDecodeVoltage(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_VBAT)]);
+	Telemetry->VsysMv = SM5714FgDecodeVoltage(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_VSYS)]);
+	Telemetry->CurrentMa = SM5714FgDecodeCurrent(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_CURRENT)]);
+	Telemetry->TemperatureDeciC = SM5714FgDecodeTemperature(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_TEMPERATURE)]);
+	Telemetry->VbatAvgMv = SM5714FgDecodeVoltage(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_VBAT_AVG)]);
+	Telemetry->CurrentAvgMa = SM5714FgDecodeCurrent(raw[SM5714_FG_SRAM_TELEMETRY_INDEX(SM5714_FG_ADDR_SRAM_CURRENT_AVG)]);
 
-	ULONG_PTR bytes = 0;
+exit:
 
-	if (Timeout == 0)
-	{
-		//
-		// Send the SPB sequence IOCTL without a timeout set
-		//
+	return status;
+}
 
-		status = WdfIoTargetSendIoctlSynchronously(
-			SpbContext->SpbIoTarget,
-			NULL,
-			IOCTL_SPB_EXECUTE_SEQUENCE,
-			&memoryDescriptor,
-			NULL,
-			NULL,
-			&bytes);
-	}
-	else
+NTSTATUS
+SpbProbeSramAutoIncrement(
+	_In_                            SPB_CONTEXT*    SpbContext
+)
+/*++
+
+  Routine Description:
+	This routine detects whether consecutive RDATA reads walk through SRAM.
+	It reads SOC and OCV once as a two word burst and once as individual
+	words; the burst matching the individual reads means the part
+	auto-increments SRAM_RADDR. Inconclusive samples (the words changed in
+	between, or SOC equals OCV) are retried, and the context falls back to
+	per-word sub-transfers unless auto-increment is positively seen.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	static const UCHAR addresses[2] = { SM5714_FG_ADDR_SRAM_SOC, SM5714_FG_ADDR_SRAM_OCV };
+	UCHAR addressWrite[3] = { (UCHAR)SM5714_FG_REG_SRAM_RADDR, SM5714_FG_ADDR_SRAM_SOC, 0 };
+	USHORT burst[2];
+	USHORT single[2];
+	ULONG attempt;
+
+	SpbContext->SramAutoIncrement = FALSE;
+	status = STATUS_SUCCESS;
+
+	for (attempt = 0; attempt < 3; attempt++)
 	{
-		//
-		// Set a request timeout
-		//
-		WDF_REQUEST_SEND_OPTIONS sendOptions;
-		WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
-		sendOptions.Timeout = WDF_REL_TIMEOUT_IN_SEC(Timeout);
+		status = SpbWriteRead(
+			SpbContext,
+			addressWrite,
+			sizeof(addressWrite),
+			&readCmd,
+			sizeof(readCmd),
+			burst,
+			sizeof(burst),
+			0);
 
-		//
-		// Send the SPB sequence IOCTL.
-		//
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
 
-		status = WdfIoTargetSendIoctlSynchronously(
-			SpbContext->SpbIoTarget,
-			NULL,
-			IOCTL_SPB_EXECUTE_SEQUENCE,
-			&memoryDescriptor,
-			NULL,
-			&sendOptions,
-			&bytes);
+		status = SpbReadSramWords(SpbContext, addresses, single, ARRAYSIZE(single), 0);
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
+
+		if (single[0] == single[1])
+		{
+			continue;
+		}
+
+		if (burst[0] == single[0] && burst[1] == single[1])
+		{
+			SpbContext->SramAutoIncrement = TRUE;
+			break;
+		}
+
+		if (burst[1] == burst[0])
+		{
+			break;
+		}
 	}
 
-	if (!NT_SUCCESS(status))
+exit:
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		SM5714_BATTERY_INFO,
+		"SRAM_RADDR auto-increment %s status:%!STATUS!",
+		SpbContext->SramAutoIncrement ? "supported" : "not supported",
+		status);
+
+	return status;
+}
+
+//
+// Bytes on the bus for one SRAM word read: the address byte of every
+// transfer entry plus the RADDR write, the RDATA write and the word.
+// The compacted layout drops one entry and with it one address phase.
+//
+#define SPB_SRAM_WORD_BUS_BYTES(Entries) \
+	((ULONG)((Entries) + sizeof(write_cycle) + sizeof(readCmd) + sizeof(USHORT)))
+
+NTSTATUS
+SpbProbeSramCompactReads(
+	_In_                            SPB_CONTEXT*    SpbContext
+)
+/*++
+
+  Routine Description:
+	This routine checks whether the controller and the gauge accept the
+	compacted SRAM read layout. It reads SOC and OCV once with the RADDR
+	and RDATA writes merged into one buffer list entry and once with the
+	split layout. Inconclusive samples (SOC equals OCV, or the words
+	changed in between) are retried, and the context keeps the split
+	layout unless the compacted reads positively match.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	static const UCHAR addresses[2] = { SM5714_FG_ADDR_SRAM_SOC, SM5714_FG_ADDR_SRAM_OCV };
+	USHORT compact[2];
+	USHORT split[2];
+	BOOLEAN supported;
+	ULONG attempt;
+
+	supported = FALSE;
+	status = STATUS_SUCCESS;
+
+	for (attempt = 0; attempt < 3; attempt++)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SM5714_BATTERY_ERROR,
-			"Failed sending SPB Sequence IOCTL bytes:%lu status:%!STATUS!",
-			(ULONG)bytes,
-			status);
+		SpbContext->SramCompactReads = TRUE;
+		status = SpbReadSramWords(SpbContext, addresses, compact, ARRAYSIZE(compact), 0);
 
-		goto exit;
-	}
+		SpbContext->SramCompactReads = FALSE;
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
 
-	//
-	// Copy the number of bytes transmitted over the bus
-	// The controller needs to support querying for actual bytes
-	// for each transaction
-	//
+		status = SpbReadSramWords(SpbContext, addresses, split, ARRAYSIZE(split), 0);
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
 
-	*BytesReturned = (ULONG)bytes;
+		if (split[0] == split[1])
+		{
+			continue;
+		}
+
+		if (compact[0] == split[0] && compact[1] == split[1])
+		{
+			supported = TRUE;
+			break;
+		}
+	}
 
 exit:
 
-	WdfWaitLockRelease(SpbContext->SpbLock);
-	WdfObjectDelete(memorySequence);
+	SpbContext->SramCompactReads = supported;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		SM5714_BATTERY_INFO,
+		"Compact SRAM reads %s, %lu bus bytes per word read (split layout %lu) "
+		"status:%!STATUS!",
+		supported ? "enabled" : "not supported",
+		SPB_SRAM_WORD_BUS_BYTES(supported ? 2 : 3),
+		SPB_SRAM_WORD_BUS_BYTES(3),
+		status);
+
 	return status;
 }
 
 NTSTATUS
-SpbWriteRead(
-	_In_                            SPB_CONTEXT* SpbContext,
-	_In_reads_(SendLength)          PVOID           SendData,
-	_In_                            USHORT          SendLength,
-	_In_reads_(CmdLength)			PVOID			ReadCmd,
-	_In_							USHORT			CmdLength,
-	_Out_writes_(DataLength)        PVOID           Data,
-	_In_                            USHORT          DataLength,
-	_In_                            ULONG           DelayUs
+SpbReadFgInterrupt(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_Out_                           PUSHORT         IntFlags,
+	_Out_                           PUSHORT         FgStatus
 )
 /*++
 
   Routine Description:
-	This routine forwards a write-read sequence to the SPB I/O target
+	This routine reads the fuel gauge INTFG and STATUS registers in a
+	single IOCTL_SPB_EXECUTE_SEQUENCE request. Reading INTFG clears the
+	latched interrupt flags, which releases the interrupt line.
   Arguments:
 	SpbContext      -       Pointer to the current device context
-	SendData                The first byte buffer containing the data
-	SendLength              The length of the first byte buffer data
-	Data                    The second byte buffer containing the data
-	Length                  The length of the second byte buffer data
-	DelayUs                 The delay between calls
+	IntFlags                Receives the INTFG register
+	FgStatus                Receives the STATUS register
   Return Value:
 	NTSTATUS Status indicating success or failure
 --*/
 {
 	NTSTATUS status;
+	UCHAR intfgAddress = SM5714_FG_REG_INTFG;
+	UCHAR statusAddress = SM5714_FG_REG_STATUS;
+	USHORT registers[2];
+	ULONGLONG startTime;
 
 	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
-	//
-	// Compact the adjacent writes of the two register accesses into a 
-	// single write transfer list entry without restarts between them.
-	//
-	//SPB_TRANSFER_BUFFER_LIST_ENTRY BufferListFirst[1];
-	//BufferListFirst[0].Buffer = SendData;
-	//BufferListFirst[0].BufferCb = SendLength;
+	startTime = SpbTraceStart();
+
+	*IntFlags = 0;
+	*FgStatus = 0;
 
 	//
 	// Build the SPB sequence
 	//
-	SPB_TRANSFER_LIST_AND_ENTRIES(3)    sequence;
-	SPB_TRANSFER_LIST_INIT(&(sequence.List), 3);
+	SPB_TRANSFER_LIST_AND_ENTRIES(4)    sequence;
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), 4);
 
 	{
 		//
 		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
+		// "struct hack" size but using an index variable quiets
 		// the warning. This is a false positive from OACR.
-		// 
+		//
 
 		ULONG index = 0;
 
 		sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
 			SpbTransferDirectionToDevice,
 			0,
-			SendData,
-			SendLength);
+			&intfgAddress,
+			sizeof(intfgAddress));
 
 		sequence.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
-			SpbTransferDirectionToDevice,
+			SpbTransferDirectionFromDevice,
 			0,
-			ReadCmd,
-			CmdLength);
+			IntFlags,
+			sizeof(USHORT));
 
 		sequence.List.Transfers[index + 2] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
-			SpbTransferDirectionFromDevice,
-			DelayUs,
-			Data,
-			DataLength);
-	}
-
-#if I2C_VERBOSE_LOGGING
-	// Log first transfer (Write 1: register + sub-address)
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CWRITE Transfer 0: LENGTH=%d", SendLength);
-	for (ULONG j = 0; j < SendLength; j++)
-	{
-		UCHAR byte = ((PUCHAR)SendData)[j];
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
-	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
+			SpbTransferDirectionToDevice,
+			0,
+			&statusAddress,
+			sizeof(statusAddress));
 
-	// Log second transfer (Write 2: Set read command)
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CWRITE Transfer 1: LENGTH=%d", CmdLength);
-	for (ULONG j = 0; j < CmdLength; j++)
-	{
-		UCHAR byte = ((PUCHAR)ReadCmd)[j];
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
+		sequence.List.Transfers[index + 3] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			0,
+			FgStatus,
+			sizeof(USHORT));
 	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
 
-	//
-	// Send the read as a Sequence request to the SPB target
-	// 
 	ULONG bytesReturned = 0;
-	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, 100);
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			SM5714_BATTERY_ERROR,
-			"SpbSequence failed sending a sequence "
+			"SpbSequence failed reading INTFG "
 			"status:%!STATUS!",
 			status);
 
 		goto exit;
 	}
 
-#if I2C_VERBOSE_LOGGING
-	// Log read result
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CREAD: LENGTH=%d", DataLength);
-	for (ULONG j = 0; j < DataLength; j++)
-	{
-		UCHAR byte = ((PUCHAR)Data)[j];
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
-	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
-
-	//
-	// Check if this is a "short transaction" i.e. the sequence
-	// resulted in lesser bytes transmitted/received than expected
-	//
-	ULONG expectedLength = SendLength + DataLength;
+	ULONG expectedLength = 2 * (sizeof(UCHAR) + sizeof(USHORT));
 	if (bytesReturned < expectedLength)
 	{
 		status = STATUS_DEVICE_PROTOCOL_ERROR;
@@ -605,9 +2290,51 @@ SpbWriteRead(
 
 exit:
 
+	registers[0] = *IntFlags;
+	registers[1] = *FgStatus;
+
+	SpbTraceTransaction(
+		SpbContext,
+		SM5714_I2C_TRACE_INTERRUPT_READ,
+		intfgAddress,
+		NULL,
+		0,
+		registers,
+		sizeof(registers),
+		status,
+		startTime);
+
 	return status;
 }
 
+NTSTATUS
+SpbWriteFgInterruptMask(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_                            USHORT          Mask
+)
+/*++
+
+  Routine Description:
+	This routine programs the fuel gauge INTFG_MASK register.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Mask                    The INTFG bits to disable
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	UCHAR data[2];
+
+	data[0] = (UCHAR)(Mask & 0xff);
+	data[1] = (UCHAR)(Mask >> 8);
+
+	return SpbWriteDataSynchronously(
+		SpbContext,
+		SM5714_FG_REG_INTFG_MASK,
+		data,
+		sizeof(data));
+}
+
 VOID
 SpbTargetDeinitialize(
 	IN WDFDEVICE FxDevice,
@@ -632,17 +2359,54 @@ SpbTargetDeinitialize(
 
 --*/
 {
+	ULONG i;
+
 	UNREFERENCED_PARAMETER(FxDevice);
-	UNREFERENCED_PARAMETER(SpbContext);
 
 	//
 	// Free any SPB_CONTEXT allocations here
 	//
+	for (i = 0; i < SPB_REQUEST_POOL_SIZE; i++)
+	{
+		//
+		// The sequence memory is parented to the request
+		//
+		if (SpbContext->RequestPool[i].Request != NULL)
+		{
+			WdfObjectDelete(SpbContext->RequestPool[i].Request);
+			SpbContext->RequestPool[i].Request = NULL;
+			SpbContext->RequestPool[i].SequenceMemory = NULL;
+		}
+	}
+
+	SpbContext->RequestFreeMask = 0;
+
+#if DBG
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		SM5714_BATTERY_INFO,
+		"Spb transport made %ld pool allocations over %ld transfers",
+		SpbContext->AllocationCount,
+		SpbContext->TransferCount);
+#endif
+
+	if (SpbContext->LargeBufferLookaside != NULL)
+	{
+		WdfObjectDelete(SpbContext->LargeBufferLookaside);
+		SpbContext->LargeBufferLookaside = NULL;
+	}
+
 	if (SpbContext->SpbLock != NULL)
 	{
 		WdfObjectDelete(SpbContext->SpbLock);
 	}
 
+	if (SpbContext->SubmissionLock != NULL)
+	{
+		WdfObjectDelete(SpbContext->SubmissionLock);
+		SpbContext->SubmissionLock = NULL;
+	}
+
 	if (SpbContext->ReadMemory != NULL)
 	{
 		WdfObjectDelete(SpbContext->ReadMemory);
@@ -684,9 +2448,17 @@ SpbTargetInitialize(
 	WCHAR spbDeviceNameBuffer[RESOURCE_HUB_PATH_SIZE];
 	NTSTATUS status;
 
+	KeQueryPerformanceCounter(&SpbContext->PerformanceFrequency);
+
 	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
 	objectAttributes.ParentObject = FxDevice;
 
+	SpbContext->SramAutoIncrement = FALSE;
+	SpbContext->SramCompactReads = FALSE;
+
+	InitializeListHead(&SpbContext->SubmissionQueue);
+	SpbContext->SubmissionActive = FALSE;
+
 	status = WdfIoTargetCreate(
 		FxDevice,
 		&objectAttributes,
@@ -785,6 +2557,34 @@ SpbTargetInitialize(
 		goto exit;
 	}
 
+	status = WdfLookasideListCreate(
+		WDF_NO_OBJECT_ATTRIBUTES,
+		LARGE_SPB_BUFFER_SIZE,
+		NonPagedPoolNx,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		SPB_POOL_TAG,
+		&SpbContext->LargeBufferLookaside);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Error creating lookaside list for Spb transfers - 0x%08lX",
+			status);
+		goto exit;
+	}
+
+	//
+	// Preallocate the requests used for sequence transfers
+	//
+	status = SpbRequestPoolInitialize(SpbContext);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
 	//
 	// Allocate a waitlock to guard access to the default buffers
 	//
@@ -802,6 +2602,23 @@ SpbTargetInitialize(
 		goto exit;
 	}
 
+	//
+	// Allocate a waitlock to guard the SRAM read submission queue
+	//
+	status = WdfWaitLockCreate(
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&SpbContext->SubmissionLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SM5714_BATTERY_ERROR,
+			"Error creating submission Waitlock - 0x%08lX",
+			status);
+		goto exit;
+	}
+
 exit:
 
 	if (!NT_SUCCESS(status))
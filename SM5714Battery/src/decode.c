@@ -0,0 +1,50 @@
+/*
+ * decode.c
+ *
+ * Lookup tables behind SM5714Battery_decode.h when it is built with
+ * SM5714_DECODE_USE_TABLES=1, generated by the preprocessor at compile time.
+ * Free of any OS dependency like the header, so the host side tests link
+ * the same file.
+ */
+
+// Forward slashes so the host side tests build this file unchanged
+#include "../inc/SM5714Battery_decode.h"
+
+#if SM5714_DECODE_USE_TABLES
+
+//
+// Table generators: SM5714_DECODE_TN(f, i) expands to f(i), f(i + 1), ...
+// f(i + N - 1), each followed by a comma.
+//
+
+#define SM5714_DECODE_T1(f, i)            f(i),
+#define SM5714_DECODE_T4(f, i)            SM5714_DECODE_T1(f, (i)) SM5714_DECODE_T1(f, (i) + 1) \
+                                          SM5714_DECODE_T1(f, (i) + 2) SM5714_DECODE_T1(f, (i) + 3)
+#define SM5714_DECODE_T16(f, i)           SM5714_DECODE_T4(f, (i)) SM5714_DECODE_T4(f, (i) + 4) \
+                                          SM5714_DECODE_T4(f, (i) + 8) SM5714_DECODE_T4(f, (i) + 12)
+#define SM5714_DECODE_T64(f, i)           SM5714_DECODE_T16(f, (i)) SM5714_DECODE_T16(f, (i) + 16) \
+                                          SM5714_DECODE_T16(f, (i) + 32) SM5714_DECODE_T16(f, (i) + 48)
+#define SM5714_DECODE_T256(f, i)          SM5714_DECODE_T64(f, (i)) SM5714_DECODE_T64(f, (i) + 64) \
+                                          SM5714_DECODE_T64(f, (i) + 128) SM5714_DECODE_T64(f, (i) + 192)
+#define SM5714_DECODE_T1024(f, i)         SM5714_DECODE_T256(f, (i)) SM5714_DECODE_T256(f, (i) + 256) \
+                                          SM5714_DECODE_T256(f, (i) + 512) SM5714_DECODE_T256(f, (i) + 768)
+#define SM5714_DECODE_T2048(f, i)         SM5714_DECODE_T1024(f, (i)) SM5714_DECODE_T1024(f, (i) + 1024)
+#define SM5714_DECODE_T4096(f, i)         SM5714_DECODE_T2048(f, (i)) SM5714_DECODE_T2048(f, (i) + 2048)
+#define SM5714_DECODE_T8192(f, i)         SM5714_DECODE_T4096(f, (i)) SM5714_DECODE_T4096(f, (i) + 4096)
+#define SM5714_DECODE_T16384(f, i)        SM5714_DECODE_T8192(f, (i)) SM5714_DECODE_T8192(f, (i) + 8192)
+
+#define SM5714_DECODE_TEMPERATURE_ENTRY(i) SM5714_FG_TEMPERATURE_DECIC((i) << 4)
+
+const unsigned short SM5714FgVoltageTable[SM5714_FG_VOLTAGE_MASK + 1] = {
+	SM5714_DECODE_T16384(SM5714_FG_VOLTAGE_MV, 0)
+};
+
+const unsigned short SM5714FgCurrentTable[SM5714_FG_CURRENT_MASK + 1] = {
+	SM5714_DECODE_T8192(SM5714_FG_CURRENT_MA, 0)
+};
+
+const unsigned short SM5714FgTemperatureTable[(SM5714_FG_TEMPERATURE_MASK >> 4) + 1] = {
+	SM5714_DECODE_T2048(SM5714_DECODE_TEMPERATURE_ENTRY, 0)
+};
+
+#endif /* SM5714_DECODE_USE_TABLES */
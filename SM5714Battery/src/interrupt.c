@@ -0,0 +1,257 @@
+/*++
+
+Module Name:
+
+	interrupt.c
+
+Abstract:
+
+	This module handles the fuel gauge alarm interrupt of the SM5714 PMIC
+	battery driver. The gauge raises its GpioInt line when the SOC, voltage
+	or temperature alarm trips, which lets the driver refresh its telemetry
+	without polling the gauge.
+
+Environment:
+
+	Kernel mode
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "..\inc\SM5714Battery.h"
+#include "..\inc\Spb.h"
+#include "interrupt.tmh"
+
+#include "..\inc\SM5714Battery_regs.h"
+
+//------------------------------------------------------------------- Prototypes
+
+EVT_WDF_INTERRUPT_ISR SM5714BatteryEvtFgInterruptIsr;
+EVT_WDF_INTERRUPT_WORKITEM SM5714BatteryEvtFgInterruptWorkItem;
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, SM5714BatteryCreateFgInterrupt)
+#pragma alloc_text(PAGE, SM5714BatteryInitializeFgInterrupt)
+#pragma alloc_text(PAGE, SM5714BatteryEvtFgInterruptIsr)
+#pragma alloc_text(PAGE, SM5714BatteryEvtFgInterruptWorkItem)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryCreateFgInterrupt(
+	WDFDEVICE Device,
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the passive-level interrupt object for the fuel
+	gauge GpioInt resource. The ISR runs at PASSIVE_LEVEL so it can talk to
+	the gauge over I2C; the rest of the work is deferred to a work item.
+
+Arguments:
+
+	Device - Supplies a handle to the framework device object.
+
+	InterruptRaw - Supplies the raw interrupt resource descriptor.
+
+	InterruptTranslated - Supplies the translated interrupt resource
+		descriptor.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	WDF_INTERRUPT_CONFIG InterruptConfig;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+
+	WDF_INTERRUPT_CONFIG_INIT(&InterruptConfig,
+		SM5714BatteryEvtFgInterruptIsr,
+		NULL);
+
+	InterruptConfig.PassiveHandling = TRUE;
+	InterruptConfig.EvtInterruptWorkItem = SM5714BatteryEvtFgInterruptWorkItem;
+	InterruptConfig.InterruptRaw = InterruptRaw;
+	InterruptConfig.InterruptTranslated = InterruptTranslated;
+
+	Status = WdfInterruptCreate(Device,
+		&InterruptConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&DevExt->FgInterrupt);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_ERROR, "WdfInterruptCreate() Failed. Status 0x%x\n", Status);
+		DevExt->FgInterrupt = NULL;
+		goto Exit;
+	}
+
+	DevExt->FgPendingFlags = 0;
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryInitializeFgInterrupt(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine unmasks the SOC, voltage and temperature alarms in
+	INTFG_MASK and drops any flags latched before the driver started.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	USHORT IntFlags;
+	USHORT FgStatus;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	Status = SpbWriteFgInterruptMask(&DevExt->I2CContext, (USHORT)~SM5714_FG_INT_ALARMS);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_ERROR, "Failed to program INTFG_MASK. Status 0x%x\n", Status);
+		goto Exit;
+	}
+
+	Status = SpbReadFgInterrupt(&DevExt->I2CContext, &IntFlags, &FgStatus);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_ERROR, "Failed to clear INTFG. Status 0x%x\n", Status);
+		goto Exit;
+	}
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO,
+		"Fuel gauge alarms enabled, stale INTFG: 0x%04X STATUS: 0x%04X\n",
+		IntFlags,
+		FgStatus);
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+SM5714BatteryEvtFgInterruptIsr(
+	WDFINTERRUPT Interrupt,
+	ULONG MessageID
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the passive-level ISR of the fuel gauge. It reads and
+	clears INTFG in one sequence, which releases the interrupt line, and
+	queues the work item that refreshes the telemetry cache.
+
+Arguments:
+
+	Interrupt - Supplies a handle to the interrupt object.
+
+	MessageID - Unused.
+
+Return Value:
+
+	TRUE if the gauge had an alarm latched.
+
+--*/
+
+{
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	USHORT IntFlags;
+	USHORT FgStatus;
+	NTSTATUS Status;
+
+	UNREFERENCED_PARAMETER(MessageID);
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(WdfInterruptGetDevice(Interrupt));
+
+	Status = SpbReadFgInterrupt(&DevExt->I2CContext, &IntFlags, &FgStatus);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_ERROR, "Failed to read INTFG. Status 0x%x\n", Status);
+		return FALSE;
+	}
+
+	if ((IntFlags & SM5714_FG_INT_ALARMS) == 0) {
+		return FALSE;
+	}
+
+	InterlockedOr(&DevExt->FgPendingFlags, IntFlags & SM5714_FG_INT_ALARMS);
+	WdfInterruptQueueWorkItemForIsr(Interrupt);
+
+	return TRUE;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryEvtFgInterruptWorkItem(
+	WDFINTERRUPT Interrupt,
+	WDFOBJECT AssociatedObject
+)
+
+/*++
+
+Routine Description:
+
+	This routine collects the alarms latched by the ISR and feeds them into
+	the telemetry cache and status notification path.
+
+Arguments:
+
+	Interrupt - Supplies a handle to the interrupt object.
+
+	AssociatedObject - Supplies a handle to the framework device object.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	LONG IntFlags;
+
+	UNREFERENCED_PARAMETER(Interrupt);
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension((WDFDEVICE)AssociatedObject);
+
+	IntFlags = InterlockedExchange(&DevExt->FgPendingFlags, 0);
+	if (IntFlags == 0) {
+		return;
+	}
+
+	SM5714BatteryHandleFgAlarm(DevExt, (USHORT)IntFlags);
+	return;
+}
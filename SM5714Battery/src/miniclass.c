@@ -45,6 +45,7 @@ BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK SM5714BatteryDisableStatusNotify;
 #pragma alloc_text(PAGE, SM5714BatteryUpdateTag)
 #pragma alloc_text(PAGE, SM5714BatteryQueryTag)
 #pragma alloc_text(PAGE, SM5714BatteryQueryInformation)
+#pragma alloc_text(PAGE, SM5714BatteryComputeStatus)
 #pragma alloc_text(PAGE, SM5714BatteryQueryStatus)
 #pragma alloc_text(PAGE, SM5714BatterySetStatusNotify)
 #pragma alloc_text(PAGE, SM5714BatteryDisableStatusNotify)
@@ -86,6 +87,7 @@ Return Value:
 
 	WdfWaitLockAcquire(DevExt->StateLock, NULL);
 	SM5714BatteryUpdateTag(DevExt);
+	SM5714BatteryInvalidateTelemetry(DevExt);
 	WdfWaitLockRelease(DevExt->StateLock);
 
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
@@ -189,32 +191,24 @@ SM5714BatteryQueryBatteryInformation(PSM5714_BATTERY_FDO_DATA DevExt, PBATTERY_I
 
 	// For a 4500 mAh Li-ion battery at 4.4 V:
 	BatteryInformationResult->DesignedCapacity = 19800; // mWh (4500mAh * 4.4V)
-	BatteryInformationResult->FullChargedCapacity = 19228; // mWh (4370mAh * 4.4V)
+	BatteryInformationResult->FullChargedCapacity = SM5714_FULL_CHARGED_CAPACITY_MWH; // mWh (4370mAh * 4.4V)
 
 	BatteryInformationResult->DefaultAlert1 = BatteryInformationResult->FullChargedCapacity * 7 / 100; // 7% of total capacity for error
 	BatteryInformationResult->DefaultAlert2 = BatteryInformationResult->FullChargedCapacity * 9 / 100; // 9% of total capacity for warning
 	BatteryInformationResult->CriticalBias = 0;
 
 	//
-	// Fetch cycle count over I2C
+	// Fetch cycle count over I2C, or from the telemetry cache
 	//
-	int  CycleCount = 0;
-	unsigned short rawCycle = 0;
+	ULONG CycleCount = 0;
 
-	Status = SpbWriteRead(&DevExt->I2CContext, (PVOID)write_cycle, sizeof(write_cycle), &readCmd, sizeof(readCmd), &rawCycle, sizeof(rawCycle), 0);
+	Status = SM5714BatteryGetCycleCount(DevExt, &CycleCount);
 	if (!NT_SUCCESS(Status))
 	{
-		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw cycle count. Status=0x%08lX\n", Status);
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to get battery cycle count. Status=0x%08lX\n", Status);
 		goto Exit;
 	}
 
-	if (rawCycle < 0) {
-		CycleCount = 0;
-	}
-	else {
-		CycleCount = rawCycle & 0x00FF;
-	}
-
 	BatteryInformationResult->CycleCount = CycleCount;
 
 	Trace(
@@ -243,87 +237,6 @@ Exit:
 	return Status;
 }
 
-/*
-NTSTATUS
-SM5714BatteryQueryBatteryEstimatedTime(
-	PSM5714_BATTERY_FDO_DATA DevExt,
-	LONG AtRate,
-	PULONG ResultValue
-)
-{
-	NTSTATUS Status = STATUS_SUCCESS;
-	UCHAR Flags = 0;
-	UINT16 ETA = 0;
-
-	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
-
-	if (AtRate == 0)
-	{
-		Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x0A, &Flags, 2);
-		if (!NT_SUCCESS(Status))
-		{
-			Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-			goto Exit;
-		}
-
-		if (Flags & (1 << 0) || Flags & (1 << 1))
-		{
-			Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x16, &ETA, 2);
-			if (!NT_SUCCESS(Status))
-			{
-				Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-				goto Exit;
-			}
-
-			if (ETA == 0xFFFF)
-			{
-				*ResultValue = BATTERY_UNKNOWN_TIME;
-
-				Trace(
-					TRACE_LEVEL_INFORMATION,
-					SM5714_BATTERY_TRACE,
-					"BatteryEstimatedTime: BATTERY_UNKNOWN_TIME\n");
-			}
-			else
-			{
-				*ResultValue = ETA * 60; // Seconds
-
-				Trace(
-					TRACE_LEVEL_INFORMATION,
-					SM5714_BATTERY_TRACE,
-					"BatteryEstimatedTime: %d seconds\n",
-					*ResultValue);
-			}
-		}
-		else
-		{
-			*ResultValue = BATTERY_UNKNOWN_TIME;
-
-			Trace(
-				TRACE_LEVEL_INFORMATION,
-				SM5714_BATTERY_TRACE,
-				"BatteryEstimatedTime: BATTERY_UNKNOWN_TIME\n");
-		}
-	}
-	else
-	{
-		*ResultValue = BATTERY_UNKNOWN_TIME;
-
-		Trace(
-			TRACE_LEVEL_INFORMATION,
-			SM5714_BATTERY_TRACE,
-			"BatteryEstimatedTime: BATTERY_UNKNOWN_TIME for AtRate = %d\n",
-			AtRate);
-	}
-
-Exit:
-	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE,
-		"Leaving %!FUNC!: Status = 0x%08lX\n",
-		Status);
-	return Status;
-}
-*/
-
 _Use_decl_annotations_
 NTSTATUS
 SM5714BatteryQueryInformation(
@@ -382,16 +295,20 @@ Return Value:
 	WCHAR StringResult[MAX_BATTERY_STRING_SIZE] = { 0 };
 	BATTERY_MANUFACTURE_DATE ManufactureDate = { 0 };
 
-	unsigned short rawTemp = 0;
+	SM5714_FG_TELEMETRY Telemetry;
 	int Temperature = 0;
 	USHORT DateData = 0;
 
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	//
+	// Battery data comes from the published snapshot, which is read without
+	// StateLock. The tag is a single aligned ULONG and is read the same way.
+	//
+
 	DevExt = (PSM5714_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
-	if (BatteryTag != DevExt->BatteryTag) {
+	if (BatteryTag != ReadULongAcquire(&DevExt->BatteryTag)) {
 		Status = STATUS_NO_SUCH_DEVICE;
 		goto QueryInformationEnd;
 	}
@@ -418,20 +335,15 @@ Return Value:
 		Status = STATUS_SUCCESS;
 		break;
 
-	/*
 	case BatteryEstimatedTime:
-		Status = SM5714BatteryQueryBatteryEstimatedTime(DevExt, AtRate, &ResultValue);
-		if (!NT_SUCCESS(Status))
-		{
-			Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "SM5714BatteryQueryBatteryEstimatedTime failed with Status = 0x%08lX\n", Status);
-			goto Exit;
-		}
+		ResultValue = SM5714BatteryGetEstimatedTime(DevExt, AtRate);
+
+		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "BatteryEstimatedTime: %d seconds at rate %d\n", ResultValue, AtRate);
 
 		ReturnBuffer = &ResultValue;
 		ReturnBufferLength = sizeof(ResultValue);
 		Status = STATUS_SUCCESS;
 		break;
-	*/
 
 	case BatteryUniqueID:
 
@@ -548,27 +460,18 @@ Return Value:
 		break;
 
 	//
-	// Fetch temperature over I2C
+	// Fetch temperature over I2C, or from the telemetry cache
 	//
 	case BatteryTemperature:
 
-		Status = SpbWriteRead(&DevExt->I2CContext, (PVOID)write_temperature, sizeof(write_temperature), &readCmd, sizeof(readCmd), &rawTemp, sizeof(rawTemp), 0);
+		Status = SM5714BatteryGetTelemetry(DevExt, &Telemetry);
 		if (!NT_SUCCESS(Status))
 		{
-			Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw battery temperature. Status=0x%08lX\n", Status);
-		}
-
-		if (rawTemp < 0) {
-			Temperature = 0;
-		}
-		else {
-			Temperature = ((rawTemp & 0x7fff) >> 8) * 10;                  //integer bit
-			Temperature = Temperature + (((rawTemp & 0x00f0) * 10) / 256); // integer + fractional bit
-			if (rawTemp & 0x8000)
-				Temperature *= -1;
+			Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to get battery temperature. Status=0x%08lX\n", Status);
+			goto Exit;
 		}
 
-		Temperature = (ULONG)Temperature / (ULONG)10;
+		Temperature = Telemetry.TemperatureDeciC / 10;
 
 		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Battery temperature: %d\n", Temperature);
 
@@ -604,11 +507,69 @@ Exit:
 	}
 
 QueryInformationEnd:
-	WdfWaitLockRelease(DevExt->StateLock);
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
 
+_Use_decl_annotations_
+VOID
+SM5714BatteryComputeStatus(
+	PSM5714_FG_TELEMETRY Telemetry,
+	PBATTERY_STATUS BatteryStatus
+)
+
+/*++
+
+Routine Description:
+
+	This routine converts a telemetry sample into the battery class status.
+
+Arguments:
+
+	Telemetry - Supplies the decoded fuel gauge telemetry.
+
+	BatteryStatus - Supplies a pointer to the structure to receive the status.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	unsigned int Capacity = Telemetry->Soc;
+	unsigned int Voltage = Telemetry->OcvMv;
+	int Current = Telemetry->CurrentMa;
+
+	PAGED_CODE();
+
+	//
+	// Fetch battery power state (use a dirty workaround for now)
+	//
+	if (Current >= 30) {
+		BatteryStatus->PowerState = BATTERY_POWER_ON_LINE;
+	}
+	else {
+		BatteryStatus->PowerState = BATTERY_DISCHARGING;
+	}
+
+	/*
+	 * BatteryStatus expects:
+	 * - Capacity in mWh
+	 * - Voltage in mV
+	 * - Rate in mW (signed)
+	 */
+
+	// (4370mAh * 4.4V = 19228 mWh)
+	BatteryStatus->Capacity = (ULONG)Capacity * SM5714_FULL_CHARGED_CAPACITY_MWH / (ULONG)1000;
+	// mV
+	BatteryStatus->Voltage = (ULONG)Voltage;
+	// mW (Signed)
+	BatteryStatus->Rate = (((LONG)Current * (LONG)Voltage) / (LONG)1000);
+
+	return;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 SM5714BatteryQueryStatus(
@@ -651,90 +612,25 @@ Return Value:
 	PAGED_CODE();
 
 	DevExt = (PSM5714_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
-	if (BatteryTag != DevExt->BatteryTag) {
+	if (BatteryTag != ReadULongAcquire(&DevExt->BatteryTag)) {
 		Status = STATUS_NO_SUCH_DEVICE;
 		goto QueryStatusEnd;
 	}
 
 	//
-	// Fetch State of Charge over I2C
+	// Fetch State of Charge, Voltage(mV) and Current (mA) over I2C,
+	// or from the telemetry cache
 	//
-	unsigned int     Capacity = 0;
-	unsigned short rawCapacity = 0;
+	SM5714_FG_TELEMETRY Telemetry;
 
-	Status = SpbWriteRead(&DevExt->I2CContext, (PVOID)write_capacity, sizeof(write_capacity), &readCmd, sizeof(readCmd), &rawCapacity, sizeof(rawCapacity), 0);
+	Status = SM5714BatteryGetTelemetry(DevExt, &Telemetry);
 	if (!NT_SUCCESS(Status))
 	{
-		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw State of Charge. Status=0x%08lX\n", Status);
-	}
-	
-	Capacity = FIXED_POINT_8_8_EXTEND_TO_INT((unsigned short)rawCapacity, 10);
-
-	//
-	// Fetch Voltage(mV) over I2C
-	//
-	unsigned int  Voltage = 0;
-	unsigned short rawOcv = 0;
-
-	Status = SpbWriteRead(&DevExt->I2CContext, (PVOID)write_ocv, sizeof(write_ocv), &readCmd, sizeof(readCmd), &rawOcv, sizeof(rawOcv), 0);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw voltage. Status=0x%08lX\n", Status);
-	}
-
-	if (rawOcv < 0) {
-		Voltage = 4000;
-	}
-	else {
-		Voltage = ((rawOcv & 0x3800) >> 11) * 1000;         //integer;
-		Voltage = Voltage + (((rawOcv & 0x07ff) * 1000) / 2048); // integer + fractional
-	}
-
-	//
-	// Fetch Current (mA) over I2C
-	//
-	int            Current = 0;
-	unsigned short rawCurr = 0;
-
-	Status = SpbWriteRead(&DevExt->I2CContext, (PVOID)write_current, sizeof(write_current), &readCmd, sizeof(readCmd), &rawCurr, sizeof(rawCurr), 0);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw current. Status=0x%08lX\n", Status);
-	}
-	Current = ((rawCurr & 0x1800) >> 11) * 1000; //integer;
-	Current = Current + (((rawCurr & 0x07ff) * 1000) / 2048); // integer + fractional
-	if (rawCurr & 0x8000)
-		Current *= -1;
-
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "CURRENT: %d mA", Current);
-
-
-	//
-	// Fetch battery power state (use a dirty workaround for now)
-	//
-	if (Current >= 30) {
-		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "BATTERY_POWER_ON_LINE\n");
-		BatteryStatus->PowerState = BATTERY_POWER_ON_LINE;
-	}
-	else {
-		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "BATTERY_DISCHARGING\n");
-		BatteryStatus->PowerState = BATTERY_DISCHARGING;
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to get battery telemetry. Status=0x%08lX\n", Status);
+		goto QueryStatusEnd;
 	}
 
-	/*
-	 * BatteryStatus expects:
-	 * - Capacity in mWh
-	 * - Voltage in mV
-	 * - Rate in mW (signed)
-	 */
-
-	// (4370mAh * 4.4V = 19228 mWh)
-	BatteryStatus->Capacity = (ULONG)Capacity * 19228 / (ULONG)1000;
-	// mV
-	BatteryStatus->Voltage = (ULONG)Voltage;
-	// mW (Signed)
-	BatteryStatus->Rate = (((LONG)Current * (LONG)Voltage) / (LONG)1000);
+	SM5714BatteryComputeStatus(&Telemetry, BatteryStatus);
 
 	// Debug: Print final BatteryStatus
 	Trace(
@@ -753,7 +649,6 @@ Return Value:
 	Status = STATUS_SUCCESS;
 
 QueryStatusEnd:
-	WdfWaitLockRelease(DevExt->StateLock);
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
@@ -793,13 +688,13 @@ Return Value:
 
 {
 	PSM5714_BATTERY_FDO_DATA DevExt;
+	BOOLEAN NotifyNow;
 	NTSTATUS Status;
 
-	UNREFERENCED_PARAMETER(BatteryNotify);
-
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	NotifyNow = FALSE;
 	DevExt = (PSM5714_BATTERY_FDO_DATA)Context;
 	WdfWaitLockAcquire(DevExt->StateLock, NULL);
 	if (BatteryTag != DevExt->BatteryTag) {
@@ -807,10 +702,29 @@ Return Value:
 		goto SetStatusNotifyEnd;
 	}
 
-	Status = STATUS_NOT_SUPPORTED;
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO,
+		"BATTERY_NOTIFY: PowerState: %d LowCapacity: %d HighCapacity: %d\n",
+		BatteryNotify->PowerState,
+		BatteryNotify->LowCapacity,
+		BatteryNotify->HighCapacity);
+
+	//
+	// Arm the window. The sampler evaluates it against every sample it takes;
+	// a window that is already crossed is reported right away.
+	//
+
+	DevExt->Notify = *BatteryNotify;
+	DevExt->NotifyArmed = TRUE;
+	NotifyNow = SM5714BatteryEvaluateNotify(DevExt);
+
+	Status = STATUS_SUCCESS;
 
 SetStatusNotifyEnd:
 	WdfWaitLockRelease(DevExt->StateLock);
+	if (NotifyNow) {
+		SM5714BatteryClassNotify(DevExt);
+	}
+
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
@@ -841,14 +755,18 @@ Return Value:
 --*/
 
 {
+	PSM5714_BATTERY_FDO_DATA DevExt;
 	NTSTATUS Status;
 
-	UNREFERENCED_PARAMETER(Context);
-
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
-	Status = STATUS_NOT_SUPPORTED;
+	DevExt = (PSM5714_BATTERY_FDO_DATA)Context;
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	DevExt->NotifyArmed = FALSE;
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Status = STATUS_SUCCESS;
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
@@ -898,8 +816,7 @@ Return Value:
 	PAGED_CODE();
 
 	DevExt = (PSM5714_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
-	if (BatteryTag != DevExt->BatteryTag) {
+	if (BatteryTag != ReadULongAcquire(&DevExt->BatteryTag)) {
 		Status = STATUS_NO_SUCH_DEVICE;
 		goto SetInformationEnd;
 	}
@@ -971,7 +888,6 @@ Return Value:
 	}
 
 SetInformationEnd:
-	WdfWaitLockRelease(DevExt->StateLock);
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
\ No newline at end of file
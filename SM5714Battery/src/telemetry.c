@@ -0,0 +1,1467 @@
+/*++
+
+Module Name:
+
+	telemetry.c
+
+Abstract:
+
+	This module keeps the last fuel gauge sample of the SM5714 PMIC battery
+	driver in memory, so repeated class driver and WMI queries are answered
+	without touching the I2C bus while the sample is fresh, and runs the
+	background sampler that keeps the sample fresh off the query path and
+	reports status notification window crossings to the class driver. Each
+	sample also updates the averages behind the estimated time, so that
+	query is answered without bus traffic.
+
+	Samples are published as a sequence-counted snapshot: writers hold
+	StateLock and raise to DISPATCH_LEVEL for the short copy, readers copy
+	without any lock and retry when they raced a writer.
+
+Environment:
+
+	Kernel mode
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "..\inc\SM5714Battery.h"
+#include "..\inc\Spb.h"
+#include "telemetry.tmh"
+
+#include "..\inc\SM5714Battery_regs.h"
+
+//------------------------------------------------------------------- Prototypes
+
+_IRQL_requires_same_
+BOOLEAN
+SM5714BatteryIsSampleFresh(
+	_In_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_In_ BOOLEAN Valid,
+	_In_ ULONGLONG Timestamp
+);
+
+_IRQL_requires_same_
+BOOLEAN
+SM5714BatteryIsBusBreakerOpen(
+	_In_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_same_
+VOID
+SM5714BatteryNoteBusResult(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_In_ NTSTATUS Status
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryRefreshTelemetry(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_Out_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryDoRefreshTelemetry(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_Out_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_same_
+ULONG
+SM5714BatterySamplerNextPeriod(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_In_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_same_
+VOID
+SM5714BatteryUpdateEstimate(
+	_Inout_ PSM5714_BATTERY_SNAPSHOT Snapshot,
+	_In_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SM5714BatteryReadSnapshot(
+	_In_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_Out_ PSM5714_BATTERY_SNAPSHOT Snapshot
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SM5714BatteryPublishTelemetry(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_In_ PSM5714_FG_TELEMETRY Telemetry
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SM5714BatteryPublishCycleCount(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_In_ ULONG CycleCount
+);
+
+_IRQL_requires_same_
+VOID
+SM5714BatteryWakeSampler(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_same_
+VOID
+SM5714BatteryNoteQuery(
+	_Inout_ PSM5714_BATTERY_FDO_DATA DevExt
+);
+
+EVT_WDF_TIMER SM5714BatteryEvtSamplerTimer;
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, SM5714BatteryLoadTelemetrySettings)
+#pragma alloc_text(PAGE, SM5714BatteryGetTelemetry)
+#pragma alloc_text(PAGE, SM5714BatteryGetCycleCount)
+#pragma alloc_text(PAGE, SM5714BatteryRefreshTelemetry)
+#pragma alloc_text(PAGE, SM5714BatteryDoRefreshTelemetry)
+#pragma alloc_text(PAGE, SM5714BatteryCreateSampler)
+#pragma alloc_text(PAGE, SM5714BatteryStartSampler)
+#pragma alloc_text(PAGE, SM5714BatteryStopSampler)
+#pragma alloc_text(PAGE, SM5714BatteryEvtSamplerTimer)
+#pragma alloc_text(PAGE, SM5714BatteryEvaluateNotify)
+#pragma alloc_text(PAGE, SM5714BatteryClassNotify)
+#pragma alloc_text(PAGE, SM5714BatteryHandleFgAlarm)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryLoadTelemetrySettings(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads the telemetry cache and SRAM read layout settings
+	from the device hardware key. Missing or unreadable values keep their
+	defaults.
+
+Arguments:
+
+	Device - Supplies a handle to the framework device object.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	WDFKEY Key;
+	ULONG Value;
+	NTSTATUS Status;
+	DECLARE_CONST_UNICODE_STRING(MaxAgeValueName, L"TelemetryMaxAgeMs");
+	DECLARE_CONST_UNICODE_STRING(CompactReadsValueName, L"SramCompactReads");
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	DevExt->TelemetryMaxAgeMs = SM5714_DEFAULT_TELEMETRY_MAX_AGE_MS;
+	DevExt->SramCompactReads = FALSE;
+
+	Status = WdfDeviceOpenRegistryKey(Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SM5714_BATTERY_WARN, "WdfDeviceOpenRegistryKey() Failed. Status 0x%x\n", Status);
+		goto Exit;
+	}
+
+	Status = WdfRegistryQueryULong(Key, &MaxAgeValueName, &Value);
+	if (NT_SUCCESS(Status)) {
+		DevExt->TelemetryMaxAgeMs = Value;
+	}
+
+	Status = WdfRegistryQueryULong(Key, &CompactReadsValueName, &Value);
+	if (NT_SUCCESS(Status)) {
+		DevExt->SramCompactReads = (Value != 0);
+	}
+
+	WdfRegistryClose(Key);
+
+Exit:
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO, "Telemetry max age: %lu ms, compact SRAM reads requested: %d\n",
+		DevExt->TelemetryMaxAgeMs,
+		DevExt->SramCompactReads);
+	return;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+SM5714BatteryIsSampleFresh(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	BOOLEAN Valid,
+	ULONGLONG Timestamp
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks a cached sample against the configured max age.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Valid - Supplies whether the cached sample was ever filled in.
+
+	Timestamp - Supplies the interrupt time at which the sample was taken.
+
+Return Value:
+
+	TRUE if the sample can be served from memory.
+
+--*/
+
+{
+	if (!Valid || DevExt->TelemetryMaxAgeMs == 0) {
+		return FALSE;
+	}
+
+	return (KeQueryInterruptTime() - Timestamp) < (ULONGLONG)MILLISECONDS(DevExt->TelemetryMaxAgeMs);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+SM5714BatteryIsBusBreakerOpen(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks whether gauge reads are currently suspended by the
+	bus circuit breaker. Once the open period has passed the breaker lets
+	the next read through.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	TRUE if the bus must not be touched.
+
+--*/
+
+{
+	return DevExt->BusBreakerOpenUntil != 0 &&
+		KeQueryInterruptTime() < DevExt->BusBreakerOpenUntil;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryNoteBusResult(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	NTSTATUS Status
+)
+
+/*++
+
+Routine Description:
+
+	This routine feeds the result of a gauge read into the bus circuit
+	breaker. A success closes it; a failure that completes a run of
+	SM5714_BUS_BREAKER_THRESHOLD failures opens it for
+	SM5714_BUS_BREAKER_OPEN_MS.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Status - Supplies the status of the bus transfer.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	if (NT_SUCCESS(Status)) {
+		if (DevExt->BusBreakerOpenUntil != 0) {
+			Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO, "Fuel gauge bus recovered, closing breaker\n");
+		}
+
+		DevExt->BusFailureCount = 0;
+		DevExt->BusBreakerOpenUntil = 0;
+		return;
+	}
+
+	DevExt->BusFailureCount += 1;
+	if (DevExt->BusFailureCount >= SM5714_BUS_BREAKER_THRESHOLD) {
+		DevExt->BusBreakerOpenUntil = KeQueryInterruptTime() + MILLISECONDS(SM5714_BUS_BREAKER_OPEN_MS);
+		Trace(TRACE_LEVEL_WARNING, SM5714_BATTERY_WARN,
+			"Fuel gauge bus failed %lu times, serving cached samples for %lu ms. Status=0x%08lX\n",
+			DevExt->BusFailureCount,
+			SM5714_BUS_BREAKER_OPEN_MS,
+			Status);
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryRefreshTelemetry(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine refreshes the telemetry from the gauge, collapsing
+	concurrent refreshes into one. The first caller performs the bus
+	transfer; callers arriving while it is in flight wait for it and share
+	its status and sample instead of issuing their own.
+
+	While the bus circuit breaker is open the last good sample is returned
+	instead, or STATUS_DEVICE_NOT_READY if there is none.
+
+	The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies a pointer to receive the telemetry.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	ULONG Generation;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	if (SM5714BatteryIsBusBreakerOpen(DevExt)) {
+		if (DevExt->Snapshot.TelemetryValid) {
+			*Telemetry = DevExt->Snapshot.Telemetry;
+			Status = STATUS_SUCCESS;
+		}
+		else {
+			Status = STATUS_DEVICE_NOT_READY;
+		}
+
+		WdfWaitLockRelease(DevExt->StateLock);
+		goto Exit;
+	}
+
+	if (!DevExt->RefreshInFlight) {
+		DevExt->RefreshInFlight = TRUE;
+		KeClearEvent(&DevExt->RefreshDone);
+		WdfWaitLockRelease(DevExt->StateLock);
+
+		Status = SM5714BatteryDoRefreshTelemetry(DevExt, Telemetry);
+
+		WdfWaitLockAcquire(DevExt->StateLock, NULL);
+		DevExt->RefreshStatus = Status;
+		DevExt->RefreshGeneration += 1;
+		DevExt->RefreshInFlight = FALSE;
+		KeSetEvent(&DevExt->RefreshDone, IO_NO_INCREMENT, FALSE);
+		WdfWaitLockRelease(DevExt->StateLock);
+		goto Exit;
+	}
+
+	//
+	// Wait for the refresh in flight to complete. The event may already be
+	// reset by a newer refresh, so completion is judged by the generation.
+	//
+
+	Generation = DevExt->RefreshGeneration;
+	while (DevExt->RefreshGeneration == Generation) {
+		WdfWaitLockRelease(DevExt->StateLock);
+		KeWaitForSingleObject(&DevExt->RefreshDone, Executive, KernelMode, FALSE, NULL);
+		WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	}
+
+	Status = DevExt->RefreshStatus;
+	if (NT_SUCCESS(Status)) {
+		*Telemetry = DevExt->Snapshot.Telemetry;
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryDoRefreshTelemetry(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine sweeps the SRAM telemetry window and publishes the result.
+	The bus transfer runs without StateLock; the lock is only taken to
+	record the result with the bus circuit breaker and to publish, after
+	checking that the battery tag did not change while the transfer was in
+	flight.
+
+	The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies a pointer to receive the telemetry.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	ULONG BatteryTag;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	BatteryTag = ReadULongAcquire(&DevExt->BatteryTag);
+
+	Status = SpbReadTelemetry(&DevExt->I2CContext, Telemetry);
+	if (!NT_SUCCESS(Status))
+	{
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB read telemetry. Status=0x%08lX\n", Status);
+	}
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	SM5714BatteryNoteBusResult(DevExt, Status);
+	if (NT_SUCCESS(Status)) {
+		if (BatteryTag != DevExt->BatteryTag) {
+			Status = STATUS_NO_SUCH_DEVICE;
+		}
+		else {
+			SM5714BatteryPublishTelemetry(DevExt, Telemetry);
+		}
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryGetTelemetry(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the decoded telemetry window. The cache is used if
+	it is younger than TelemetryMaxAgeMs, or than the sampler period while
+	the background sampler is running since it refreshes the cache that
+	often, and is refreshed from the gauge if not. A query also wakes up a
+	sampler that suspended itself for lack of queries; the sample such a
+	sampler left behind is not fresh, so whether the sampler was running is
+	taken before the wake.
+
+	Cached samples are read without a lock; a refresh takes StateLock only
+	to publish its result. The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies a pointer to receive the telemetry.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SM5714_BATTERY_SNAPSHOT Snapshot;
+	NTSTATUS Status;
+	ULONG MaxAgeMs;
+
+	PAGED_CODE();
+
+	MaxAgeMs = DevExt->TelemetryMaxAgeMs;
+	if (MaxAgeMs != 0 && DevExt->SamplerRunning && DevExt->SamplerPeriodMs > MaxAgeMs) {
+		MaxAgeMs = DevExt->SamplerPeriodMs;
+	}
+
+	SM5714BatteryNoteQuery(DevExt);
+
+	SM5714BatteryReadSnapshot(DevExt, &Snapshot);
+	if (Snapshot.TelemetryValid && MaxAgeMs != 0 &&
+		(KeQueryInterruptTime() - Snapshot.TelemetryTimestamp) < (ULONGLONG)MILLISECONDS(MaxAgeMs)) {
+		*Telemetry = Snapshot.Telemetry;
+		Status = STATUS_SUCCESS;
+		goto Exit;
+	}
+
+	Status = SM5714BatteryRefreshTelemetry(DevExt, Telemetry);
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryGetCycleCount(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PULONG CycleCount
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the battery cycle count, from the cache if it is
+	younger than TelemetryMaxAgeMs or the bus circuit breaker is open,
+	otherwise from the SOC_CYCLE SRAM word. The bus transfer runs without
+	StateLock.
+
+	The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	CycleCount - Supplies a pointer to receive the cycle count.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SM5714_BATTERY_SNAPSHOT Snapshot;
+	ULONG BatteryTag;
+	NTSTATUS Status;
+	unsigned short rawCycle = 0;
+	static const UCHAR CycleAddress = SM5714_FG_ADDR_SRAM_SOC_CYCLE;
+
+	PAGED_CODE();
+
+	SM5714BatteryReadSnapshot(DevExt, &Snapshot);
+	if (SM5714BatteryIsSampleFresh(DevExt, Snapshot.CycleCountValid, Snapshot.CycleCountTimestamp)) {
+		*CycleCount = Snapshot.CycleCount;
+		Status = STATUS_SUCCESS;
+		goto Exit;
+	}
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	if (SM5714BatteryIsBusBreakerOpen(DevExt)) {
+		if (DevExt->Snapshot.CycleCountValid) {
+			*CycleCount = DevExt->Snapshot.CycleCount;
+			Status = STATUS_SUCCESS;
+		}
+		else {
+			Status = STATUS_DEVICE_NOT_READY;
+		}
+
+		WdfWaitLockRelease(DevExt->StateLock);
+		goto Exit;
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	BatteryTag = ReadULongAcquire(&DevExt->BatteryTag);
+
+	//
+	// Goes through the SRAM read submission queue so it shares a sequence
+	// with a concurrent telemetry sweep
+	//
+	Status = SpbReadSramWords(&DevExt->I2CContext, &CycleAddress, &rawCycle, 1, 0);
+	if (!NT_SUCCESS(Status))
+	{
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_TRACE, "Failed to SPB write/read raw cycle count. Status=0x%08lX\n", Status);
+	}
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	SM5714BatteryNoteBusResult(DevExt, Status);
+	if (!NT_SUCCESS(Status)) {
+		WdfWaitLockRelease(DevExt->StateLock);
+		goto Exit;
+	}
+
+	*CycleCount = rawCycle & 0x00FF;
+
+	if (BatteryTag != DevExt->BatteryTag) {
+		Status = STATUS_NO_SUCH_DEVICE;
+	}
+	else {
+		SM5714BatteryPublishCycleCount(DevExt, *CycleCount);
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryInvalidateTelemetry(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine drops the cached samples so the next query reads the gauge,
+	and restarts the estimated time averages.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	KIRQL OldIrql;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	DevExt->Snapshot.TelemetryValid = FALSE;
+	DevExt->Snapshot.CycleCountValid = FALSE;
+	DevExt->Snapshot.EstimateValid = FALSE;
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	KeLowerIrql(OldIrql);
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryNoteQuery(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine records query activity without taking StateLock, and only
+	takes it to restart a sampler that suspended itself.
+
+	The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	InterlockedExchange64(&DevExt->LastQueryTimestamp, (LONG64)KeQueryInterruptTime());
+
+	if (DevExt->SamplerEnabled && !DevExt->SamplerRunning) {
+		WdfWaitLockAcquire(DevExt->StateLock, NULL);
+		SM5714BatteryWakeSampler(DevExt);
+		WdfWaitLockRelease(DevExt->StateLock);
+	}
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryWakeSampler(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine records query activity and restarts the sampler if it had
+	suspended itself because nobody was asking for battery data.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	InterlockedExchange64(&DevExt->LastQueryTimestamp, (LONG64)KeQueryInterruptTime());
+
+	if (DevExt->SamplerEnabled && !DevExt->SamplerRunning) {
+		DevExt->SamplerRunning = TRUE;
+		DevExt->SamplerPeriodMs = SM5714_SAMPLER_FAST_PERIOD_MS;
+		WdfTimerStart(DevExt->SamplerTimer, WDF_REL_TIMEOUT_IN_MS(DevExt->SamplerPeriodMs));
+	}
+
+	return;
+}
+
+_Use_decl_annotations_
+ULONG
+SM5714BatterySamplerNextPeriod(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine picks the delay until the next background sample. Swinging
+	current, a charge near the alert level or a capacity close to the armed
+	notification window selects the fast period; steady readings double the
+	period up to the slow period.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies the sample that was just taken.
+
+Return Value:
+
+	The next sampling period in milliseconds.
+
+--*/
+
+{
+	BATTERY_STATUS BatteryStatus;
+	BOOLEAN NearWindow;
+	LONG Delta;
+	ULONG Period;
+
+	Delta = Telemetry->CurrentMa - DevExt->SamplerLastCurrentMa;
+	if (Delta < 0) {
+		Delta = -Delta;
+	}
+
+	DevExt->SamplerLastCurrentMa = Telemetry->CurrentMa;
+
+	NearWindow = FALSE;
+	if (DevExt->NotifyArmed) {
+		SM5714BatteryComputeStatus(Telemetry, &BatteryStatus);
+
+		if (DevExt->Notify.LowCapacity != BATTERY_UNKNOWN_CAPACITY &&
+			BatteryStatus.Capacity <= DevExt->Notify.LowCapacity + SM5714_SAMPLER_NOTIFY_MARGIN_MWH) {
+			NearWindow = TRUE;
+		}
+
+		if (DevExt->Notify.HighCapacity != BATTERY_UNKNOWN_CAPACITY &&
+			BatteryStatus.Capacity + SM5714_SAMPLER_NOTIFY_MARGIN_MWH >= DevExt->Notify.HighCapacity) {
+			NearWindow = TRUE;
+		}
+	}
+
+	if (Delta >= SM5714_SAMPLER_CURRENT_DELTA_MA ||
+		Telemetry->Soc <= SM5714_SAMPLER_LOW_SOC ||
+		NearWindow) {
+		Period = SM5714_SAMPLER_FAST_PERIOD_MS;
+	}
+	else {
+		Period = DevExt->SamplerPeriodMs * 2;
+		if (Period > SM5714_SAMPLER_SLOW_PERIOD_MS) {
+			Period = SM5714_SAMPLER_SLOW_PERIOD_MS;
+		}
+	}
+
+	return Period;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryEvtSamplerTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the passive-level sampler timer callback. It refreshes
+	the telemetry cache, checks the notification window, and re-arms the
+	one-shot timer with an adapted period, or lets the sampler go idle when
+	no query arrived for the idle timeout and no window is armed.
+
+Arguments:
+
+	Timer - Supplies a handle to the sampler timer.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	SM5714_FG_TELEMETRY Telemetry;
+	BOOLEAN NotifyNow;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	NotifyNow = FALSE;
+	DevExt = GetDeviceExtension(WdfTimerGetParentObject(Timer));
+
+	//
+	// The sample is taken without StateLock, SamplerEnabled is checked again
+	// afterwards in case the sampler was stopped meanwhile.
+	//
+
+	if (!DevExt->SamplerEnabled) {
+		WdfWaitLockAcquire(DevExt->StateLock, NULL);
+		DevExt->SamplerRunning = FALSE;
+		goto SamplerTimerEnd;
+	}
+
+	Status = SM5714BatteryRefreshTelemetry(DevExt, &Telemetry);
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	if (!DevExt->SamplerEnabled) {
+		DevExt->SamplerRunning = FALSE;
+		goto SamplerTimerEnd;
+	}
+
+	if (NT_SUCCESS(Status)) {
+		NotifyNow = SM5714BatteryEvaluateNotify(DevExt);
+		DevExt->SamplerPeriodMs = SM5714BatterySamplerNextPeriod(DevExt, &Telemetry);
+	}
+
+	//
+	// An armed notification window keeps the sampler going, the class
+	// driver relies on it instead of polling. This holds with the fuel
+	// gauge alarm interrupt connected too: the alarms cover SOC, voltage
+	// and temperature thresholds, not AC plug/unplug or the capacity
+	// window, so only the sampler can see those cross.
+	//
+
+	if (!DevExt->NotifyArmed &&
+		(KeQueryInterruptTime() - (ULONGLONG)ReadNoFence64(&DevExt->LastQueryTimestamp)) >= (ULONGLONG)MILLISECONDS(SM5714_SAMPLER_IDLE_TIMEOUT_MS)) {
+		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO, "Sampler idle, suspending\n");
+		DevExt->SamplerRunning = FALSE;
+		goto SamplerTimerEnd;
+	}
+
+	WdfTimerStart(DevExt->SamplerTimer, WDF_REL_TIMEOUT_IN_MS(DevExt->SamplerPeriodMs));
+
+SamplerTimerEnd:
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (NotifyNow) {
+		SM5714BatteryClassNotify(DevExt);
+	}
+
+	return;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryCreateSampler(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the passive-level one-shot timer that drives the
+	background sampler. The timer is parented to the device.
+
+Arguments:
+
+	Device - Supplies a handle to the framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES TimerAttributes;
+	WDF_TIMER_CONFIG TimerConfig;
+	PSM5714_BATTERY_FDO_DATA DevExt;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	DevExt->SamplerEnabled = FALSE;
+	DevExt->SamplerRunning = FALSE;
+
+	WDF_TIMER_CONFIG_INIT(&TimerConfig, SM5714BatteryEvtSamplerTimer);
+	TimerConfig.AutomaticSerialization = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+	TimerAttributes.ParentObject = Device;
+	TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+	Status = WdfTimerCreate(&TimerConfig, &TimerAttributes, &DevExt->SamplerTimer);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SM5714_BATTERY_ERROR, "WdfTimerCreate(SamplerTimer) Failed. Status 0x%x\n", Status);
+	}
+
+	return Status;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryStartSampler(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine enables the background sampler and schedules the first
+	sample at the fast period.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	DevExt->SamplerEnabled = TRUE;
+	DevExt->SamplerRunning = FALSE;
+	SM5714BatteryWakeSampler(DevExt);
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryStopSampler(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine disables the background sampler and waits for a sample in
+	progress to finish. Once SamplerEnabled is cleared the timer callback no
+	longer re-arms itself.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PAGED_CODE();
+
+	if (DevExt->SamplerTimer == NULL) {
+		return;
+	}
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	DevExt->SamplerEnabled = FALSE;
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	WdfTimerStop(DevExt->SamplerTimer, TRUE);
+
+	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	DevExt->SamplerRunning = FALSE;
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	return;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+SM5714BatteryEvaluateNotify(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks the cached sample against the armed notification
+	window. The window is crossed when the power state differs from the one
+	the class driver last saw, or the capacity leaves the
+	[LowCapacity, HighCapacity] range. A crossed window is disarmed, one
+	that stays armed restarts an idle sampler.
+
+	The caller must hold StateLock, and must call SM5714BatteryClassNotify
+	after releasing it when this routine returns TRUE.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	TRUE if the class driver has to be notified.
+
+--*/
+
+{
+	BATTERY_STATUS BatteryStatus;
+	BOOLEAN Crossed;
+
+	PAGED_CODE();
+
+	if (!DevExt->NotifyArmed || !DevExt->Snapshot.TelemetryValid) {
+		return FALSE;
+	}
+
+	SM5714BatteryComputeStatus(&DevExt->Snapshot.Telemetry, &BatteryStatus);
+
+	Crossed = FALSE;
+	if (BatteryStatus.PowerState != DevExt->Notify.PowerState) {
+		Crossed = TRUE;
+	}
+
+	if (DevExt->Notify.LowCapacity != BATTERY_UNKNOWN_CAPACITY &&
+		BatteryStatus.Capacity < DevExt->Notify.LowCapacity) {
+		Crossed = TRUE;
+	}
+
+	if (DevExt->Notify.HighCapacity != BATTERY_UNKNOWN_CAPACITY &&
+		BatteryStatus.Capacity > DevExt->Notify.HighCapacity) {
+		Crossed = TRUE;
+	}
+
+	if (Crossed) {
+		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO,
+			"Notification window crossed: PowerState: %d Capacity: %d\n",
+			BatteryStatus.PowerState,
+			BatteryStatus.Capacity);
+
+		DevExt->NotifyArmed = FALSE;
+	}
+	else if (!DevExt->SamplerRunning) {
+
+		//
+		// The window stays armed, wake the sampler so it gets evaluated.
+		//
+
+		SM5714BatteryWakeSampler(DevExt);
+	}
+
+	return Crossed;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryClassNotify(
+	PSM5714_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine tells the battery class driver that the status changed.
+	It must not be called with StateLock held, since the class driver
+	answers by querying the status.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(DevExt->ClassInitLock, NULL);
+	if (DevExt->ClassHandle != NULL) {
+		BatteryClassStatusNotify(DevExt->ClassHandle);
+	}
+
+	WdfWaitLockRelease(DevExt->ClassInitLock);
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryHandleFgAlarm(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	USHORT IntFlags
+)
+
+/*++
+
+Routine Description:
+
+	This routine refreshes the telemetry cache after a fuel gauge alarm
+	interrupt and reports a crossed notification window to the class
+	driver. It does not wake an idle sampler.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	IntFlags - Supplies the INTFG bits that were latched.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	SM5714_FG_TELEMETRY Telemetry;
+	BOOLEAN NotifyNow;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO, "Fuel gauge alarm INTFG: 0x%04X\n", IntFlags);
+
+	NotifyNow = FALSE;
+	Status = SM5714BatteryRefreshTelemetry(DevExt, &Telemetry);
+	if (NT_SUCCESS(Status)) {
+		WdfWaitLockAcquire(DevExt->StateLock, NULL);
+		NotifyNow = SM5714BatteryEvaluateNotify(DevExt);
+		WdfWaitLockRelease(DevExt->StateLock);
+	}
+	if (NotifyNow) {
+		SM5714BatteryClassNotify(DevExt);
+	}
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryUpdateEstimate(
+	PSM5714_BATTERY_SNAPSHOT Snapshot,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine folds a new sample of CURRENT_AVG and VBAT_AVG into the
+	estimated time averages. The first sample after an invalidation seeds
+	the averages directly.
+
+	Called from SM5714BatteryPublishTelemetry inside the snapshot update.
+
+Arguments:
+
+	Snapshot - Supplies the snapshot being published.
+
+	Telemetry - Supplies the new sample.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	LONGLONG Current;
+	LONGLONG Voltage;
+
+	Current = (LONGLONG)Telemetry->CurrentAvgMa * (1 << SM5714_ESTIMATE_EMA_FRACTION_BITS);
+	Voltage = (LONGLONG)Telemetry->VbatAvgMv * (1 << SM5714_ESTIMATE_EMA_FRACTION_BITS);
+
+	if (!Snapshot->EstimateValid) {
+		Snapshot->EstimateCurrentAvg = Current;
+		Snapshot->EstimateVoltageAvg = Voltage;
+		Snapshot->EstimateValid = TRUE;
+		return;
+	}
+
+	Snapshot->EstimateCurrentAvg += (Current - Snapshot->EstimateCurrentAvg) / (1 << SM5714_ESTIMATE_EMA_SHIFT);
+	Snapshot->EstimateVoltageAvg += (Voltage - Snapshot->EstimateVoltageAvg) / (1 << SM5714_ESTIMATE_EMA_SHIFT);
+	return;
+}
+
+_Use_decl_annotations_
+ULONG
+SM5714BatteryGetEstimatedTime(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	LONG AtRate
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the estimated time to empty from the remaining
+	capacity and the averaged discharge rate, or from AtRate when the class
+	driver supplies one. Only the cached sample and averages are used.
+
+	While charging the time to full is traced, but the class driver has no
+	level for it and BATTERY_UNKNOWN_TIME is returned.
+
+	The caller must not hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	AtRate - Supplies the discharge rate in mW to estimate for, or 0 to use
+		the measured rate.
+
+Return Value:
+
+	The estimated time in seconds, or BATTERY_UNKNOWN_TIME.
+
+--*/
+
+{
+	SM5714_BATTERY_SNAPSHOT Snapshot;
+	LONGLONG CurrentMa;
+	LONGLONG VoltageMv;
+	LONGLONG RateMw;
+	LONGLONG RemainingMwh;
+
+	//
+	// Keep the sampler, and with it the averages, going.
+	//
+
+	SM5714BatteryNoteQuery(DevExt);
+
+	SM5714BatteryReadSnapshot(DevExt, &Snapshot);
+	if (!Snapshot.EstimateValid || !Snapshot.TelemetryValid) {
+		return BATTERY_UNKNOWN_TIME;
+	}
+
+	RemainingMwh = (LONGLONG)Snapshot.Telemetry.Soc * SM5714_FULL_CHARGED_CAPACITY_MWH / 1000;
+
+	if (AtRate != 0) {
+		RateMw = AtRate;
+	}
+	else {
+		CurrentMa = Snapshot.EstimateCurrentAvg / (1 << SM5714_ESTIMATE_EMA_FRACTION_BITS);
+		VoltageMv = Snapshot.EstimateVoltageAvg / (1 << SM5714_ESTIMATE_EMA_FRACTION_BITS);
+
+		if (CurrentMa > -SM5714_ESTIMATE_MIN_CURRENT_MA &&
+			CurrentMa < SM5714_ESTIMATE_MIN_CURRENT_MA) {
+			return BATTERY_UNKNOWN_TIME;
+		}
+
+		RateMw = CurrentMa * VoltageMv / 1000;
+	}
+
+	if (RateMw > 0) {
+		if (RemainingMwh < SM5714_FULL_CHARGED_CAPACITY_MWH) {
+			Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO,
+				"Time to full: %I64d seconds\n",
+				(SM5714_FULL_CHARGED_CAPACITY_MWH - RemainingMwh) * 3600 / RateMw);
+		}
+
+		return BATTERY_UNKNOWN_TIME;
+	}
+
+	if (RateMw == 0) {
+		return BATTERY_UNKNOWN_TIME;
+	}
+
+	return (ULONG)(RemainingMwh * 3600 / -RateMw);
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryReadSnapshot(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_BATTERY_SNAPSHOT Snapshot
+)
+
+/*++
+
+Routine Description:
+
+	This routine copies the published snapshot without taking a lock. The
+	copy is retried while a writer is inside its update (odd sequence) or
+	when the sequence changed during the copy.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Snapshot - Supplies a pointer to receive a consistent copy.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	LONG Sequence;
+
+	for (;;) {
+		Sequence = ReadAcquire(&DevExt->SnapshotSequence);
+		if ((Sequence & 1) == 0) {
+			RtlCopyMemory(Snapshot, (PVOID)&DevExt->Snapshot, sizeof(*Snapshot));
+			KeMemoryBarrier();
+			if (ReadNoFence(&DevExt->SnapshotSequence) == Sequence) {
+				break;
+			}
+		}
+
+		YieldProcessor();
+	}
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryPublishTelemetry(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PSM5714_FG_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes a new telemetry sample and folds it into the
+	estimated time averages. The update runs at DISPATCH_LEVEL so a reader
+	on the same processor never spins on a preempted writer.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies the new sample.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONGLONG Timestamp;
+	KIRQL OldIrql;
+
+	Timestamp = KeQueryInterruptTime();
+
+	KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	DevExt->Snapshot.Telemetry = *Telemetry;
+	DevExt->Snapshot.TelemetryTimestamp = Timestamp;
+	DevExt->Snapshot.TelemetryValid = TRUE;
+	SM5714BatteryUpdateEstimate(&DevExt->Snapshot, Telemetry);
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	KeLowerIrql(OldIrql);
+
+	return;
+}
+
+_Use_decl_annotations_
+VOID
+SM5714BatteryPublishCycleCount(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	ULONG CycleCount
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes a new cycle count.
+
+	The caller must hold StateLock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	CycleCount - Supplies the cycle count read from the gauge.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONGLONG Timestamp;
+	KIRQL OldIrql;
+
+	Timestamp = KeQueryInterruptTime();
+
+	KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	DevExt->Snapshot.CycleCount = CycleCount;
+	DevExt->Snapshot.CycleCountTimestamp = Timestamp;
+	DevExt->Snapshot.CycleCountValid = TRUE;
+	InterlockedIncrement(&DevExt->SnapshotSequence);
+	KeLowerIrql(OldIrql);
+
+	return;
+}
@@ -26,6 +26,8 @@ DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD SM5714BatteryDriverDeviceAdd;
 EVT_WDF_DEVICE_SELF_MANAGED_IO_INIT  SM5714BatterySelfManagedIoInit;
 EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP  SM5714BatterySelfManagedIoCleanup;
+EVT_WDF_DEVICE_SELF_MANAGED_IO_SUSPEND  SM5714BatterySelfManagedIoSuspend;
+EVT_WDF_DEVICE_SELF_MANAGED_IO_RESTART  SM5714BatterySelfManagedIoRestart;
 EVT_WDF_DEVICE_QUERY_STOP SM5714BatteryQueryStop;
 EVT_WDF_DEVICE_PREPARE_HARDWARE SM5714BatteryDevicePrepareHardware;
 EVT_WDFDEVICE_WDM_IRP_PREPROCESS SM5714BatteryWdmIrpPreprocessDeviceControl;
@@ -35,14 +37,24 @@ WMI_QUERY_DATABLOCK_CALLBACK SM5714BatteryQueryWmiDataBlock;
 EVT_WDF_DRIVER_UNLOAD SM5714BatteryEvtDriverUnload;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP SM5714BatteryEvtDriverContextCleanup;
 
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SM5714BatteryDiagnosticsIoctl(
+	_In_ PSM5714_BATTERY_FDO_DATA DevExt,
+	_Inout_ PIRP Irp
+);
+
 //---------------------------------------------------------------------- Pragmas
 
 #pragma alloc_text(INIT, DriverEntry)
 #pragma alloc_text(PAGE, SM5714BatterySelfManagedIoInit)
 #pragma alloc_text(PAGE, SM5714BatterySelfManagedIoCleanup)
+#pragma alloc_text(PAGE, SM5714BatterySelfManagedIoSuspend)
+#pragma alloc_text(PAGE, SM5714BatterySelfManagedIoRestart)
 #pragma alloc_text(PAGE, SM5714BatteryQueryStop)
 #pragma alloc_text(PAGE, SM5714BatteryDriverDeviceAdd)
 #pragma alloc_text(PAGE, SM5714BatteryDevicePrepareHardware)
+#pragma alloc_text(PAGE, SM5714BatteryDiagnosticsIoctl)
 #pragma alloc_text(PAGE, SM5714BatteryWdmIrpPreprocessDeviceControl)
 #pragma alloc_text(PAGE, SM5714BatteryWdmIrpPreprocessSystemControl)
 #pragma alloc_text(PAGE, SM5714BatteryQueryWmiRegInfo)
@@ -189,6 +201,8 @@ Return Value:
 	PnpPowerCallbacks.EvtDevicePrepareHardware = SM5714BatteryDevicePrepareHardware;
 	PnpPowerCallbacks.EvtDeviceSelfManagedIoInit = SM5714BatterySelfManagedIoInit;
 	PnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = SM5714BatterySelfManagedIoCleanup;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoSuspend = SM5714BatterySelfManagedIoSuspend;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoRestart = SM5714BatterySelfManagedIoRestart;
 	PnpPowerCallbacks.EvtDeviceQueryStop = SM5714BatteryQueryStop;
 	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &PnpPowerCallbacks);
 
@@ -267,6 +281,13 @@ Return Value:
 		goto DriverDeviceAddEnd;
 	}
 
+	KeInitializeEvent(&DevExt->RefreshDone, NotificationEvent, TRUE);
+
+	Status = SM5714BatteryCreateSampler(DeviceHandle);
+	if (!NT_SUCCESS(Status)) {
+		goto DriverDeviceAddEnd;
+	}
+
 DriverDeviceAddEnd:
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
@@ -359,6 +380,12 @@ Return Value:
 		Status = STATUS_SUCCESS;
 	}
 
+	//
+	// Start refreshing telemetry in the background, off the query path.
+	//
+
+	SM5714BatteryStartSampler(DevExt);
+
 DevicePrepareHardwareEnd:
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
@@ -396,6 +423,9 @@ Return Value:
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	DevExt = GetDeviceExtension(Device);
+	SM5714BatteryStopSampler(DevExt);
+
 	DeviceObject = WdfDeviceWdmGetDeviceObject(Device);
 	Status = IoWMIRegistrationControl(DeviceObject, WMIREG_ACTION_DEREGISTER);
 	if (!NT_SUCCESS(Status)) {
@@ -403,7 +433,6 @@ Return Value:
 		Status = STATUS_SUCCESS;
 	}
 
-	DevExt = GetDeviceExtension(Device);
 	WdfWaitLockAcquire(DevExt->ClassInitLock, NULL);
 	if (DevExt->ClassHandle != NULL) {
 		Status = BatteryClassUnload(DevExt->ClassHandle);
@@ -415,6 +444,81 @@ Return Value:
 	return;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatterySelfManagedIoSuspend(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	The framework calls this function before the device leaves D0. The
+	background sampler is stopped here so that its timer does not keep
+	issuing I2C transfers to a powered-down fuel gauge.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	PSM5714_BATTERY_FDO_DATA DevExt;
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	SM5714BatteryStopSampler(DevExt);
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatterySelfManagedIoRestart(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	The framework calls this function when the device returns to D0 after
+	SM5714BatterySelfManagedIoSuspend. It restarts the background sampler.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	PSM5714_BATTERY_FDO_DATA DevExt;
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	SM5714BatteryStartSampler(DevExt);
+
+	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 SM5714BatteryQueryStop(
@@ -501,6 +605,7 @@ Return Value:
 {
 	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
 	PCM_PARTIAL_RESOURCE_DESCRIPTOR res, resRaw;
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR intRes = NULL, intResRaw = NULL;
 	ULONG resourceCount;
 	ULONG i;
 
@@ -510,9 +615,11 @@ Return Value:
 	PSM5714_BATTERY_FDO_DATA devContext = GetDeviceExtension(Device);
 
 	devContext->Device = Device;
+	devContext->FgInterrupt = NULL;
 
 	//
-	// Get the resouce hub connection ID for our I2C driver
+	// Get the resouce hub connection ID for our I2C driver, and the
+	// optional fuel gauge alarm interrupt
 	//
 	resourceCount = WdfCmResourceListGetCount(ResourcesTranslated);
 
@@ -532,6 +639,11 @@ Return Value:
 
 			status = STATUS_SUCCESS;
 		}
+		else if (res->Type == CmResourceTypeInterrupt && intRes == NULL)
+		{
+			intRes = res;
+			intResRaw = resRaw;
+		}
 	}
 
 	if (!NT_SUCCESS(status))
@@ -551,6 +663,63 @@ Return Value:
 		goto exit;
 	}
 
+	//
+	// Find out whether SRAM windows can be read as a single burst.
+	// Failure is nonfatal, reads fall back to per-word sub-transfers.
+	//
+	status = SpbProbeSramAutoIncrement(&devContext->I2CContext);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(TRACE_LEVEL_WARNING, SM5714_BATTERY_WARN, "Error probing SRAM auto-increment - %!STATUS!", status);
+		status = STATUS_SUCCESS;
+	}
+
+	//
+	// The compacted SRAM read layout is opt-in and only kept when it reads
+	// back the same words as the split layout.
+	//
+	SM5714BatteryLoadTelemetrySettings(Device);
+
+	if (devContext->SramCompactReads)
+	{
+		status = SpbProbeSramCompactReads(&devContext->I2CContext);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(TRACE_LEVEL_WARNING, SM5714_BATTERY_WARN, "Error probing compact SRAM reads - %!STATUS!", status);
+			status = STATUS_SUCCESS;
+		}
+	}
+
+	//
+	// Without an interrupt the sampler keeps polling the gauge, so failing
+	// to set it up is nonfatal as well.
+	//
+	if (intRes != NULL)
+	{
+		//
+		// Program INTFG_MASK before creating the interrupt object: if the
+		// alarms stay masked no object exists for the sampler to rely on.
+		//
+		status = SM5714BatteryInitializeFgInterrupt(devContext);
+
+		if (NT_SUCCESS(status))
+		{
+			status = SM5714BatteryCreateFgInterrupt(Device, intResRaw, intRes);
+		}
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(TRACE_LEVEL_WARNING, SM5714_BATTERY_WARN, "Error setting up fuel gauge interrupt - %!STATUS!", status);
+			status = STATUS_SUCCESS;
+		}
+	}
+	else
+	{
+		Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_INFO, "No fuel gauge interrupt resource, polling only\n");
+	}
+
 	SM5714BatteryPrepareHardware(Device);
 
 exit:
@@ -558,6 +727,86 @@ exit:
 	return status;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+SM5714BatteryDiagnosticsIoctl(
+	PSM5714_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles the private I2C trace and statistics IOCTLs and
+	completes the IRP. Like BatteryClassIoctl it leaves any other IOCTL
+	untouched and returns STATUS_NOT_SUPPORTED for it.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	ULONG BytesWritten;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	BytesWritten = 0;
+
+	switch (IrpSp->Parameters.DeviceIoControl.IoControlCode) {
+	case IOCTL_SM5714_BATTERY_READ_I2C_TRACE:
+
+		//
+		// The input, the last sequence the caller has seen, is consumed
+		// before the output overwrites it.
+		//
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONGLONG)) {
+			Status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		Status = SpbTraceDrain(&DevExt->I2CContext,
+			*(PULONGLONG)Irp->AssociatedIrp.SystemBuffer,
+			Irp->AssociatedIrp.SystemBuffer,
+			IrpSp->Parameters.DeviceIoControl.OutputBufferLength,
+			&BytesWritten);
+
+		break;
+
+	case IOCTL_SM5714_BATTERY_READ_SPB_STATISTICS:
+		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SM5714_SPB_STATISTICS)) {
+			Status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		SpbQueryStatistics(&DevExt->I2CContext, Irp->AssociatedIrp.SystemBuffer);
+		BytesWritten = sizeof(SM5714_SPB_STATISTICS);
+		Status = STATUS_SUCCESS;
+		break;
+
+	default:
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	Irp->IoStatus.Status = Status;
+	Irp->IoStatus.Information = BytesWritten;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+	return Status;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 SM5714BatteryWdmIrpPreprocessDeviceControl(
@@ -570,7 +819,8 @@ SM5714BatteryWdmIrpPreprocessDeviceControl(
 Routine Description:
 
 	This event is called when the framework receives IRP_MJ_DEVICE_CONTROL
-	requests from the system.
+	requests from the system. The private I2C trace and statistics IOCTLs
+	are handled here, everything else goes to the battery class driver.
 
 	N.B. Battery stack requires the device IOCTLs be sent to it at
 		 PASSIVE_LEVEL only, any IOCTL comming from user mode is therefore
@@ -603,6 +853,15 @@ Return Value:
 	DevExt = GetDeviceExtension(Device);
 	Status = STATUS_NOT_SUPPORTED;
 
+	//
+	// Private I2C diagnostics IOCTLs are completed here
+	//
+
+	Status = SM5714BatteryDiagnosticsIoctl(DevExt, Irp);
+	if (Status != STATUS_NOT_SUPPORTED) {
+		goto Exit;
+	}
+
 	//
 	// Suppress 28118:Irq Exceeds Caller, see Routine Description for
 	// explaination.
@@ -635,6 +894,7 @@ Return Value:
 		Status = WdfDeviceWdmDispatchPreprocessedIrp(Device, Irp);
 	}
 
+Exit:
 	Trace(TRACE_LEVEL_INFORMATION, SM5714_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
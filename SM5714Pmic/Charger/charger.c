@@ -13,18 +13,36 @@ unsigned int input_current_limit = 1300;
 unsigned int charging_current = 1300;
 unsigned int topoff_current = 225;
 
-int set_autostop(_In_ PDEVICE_CONTEXT pDevice, bool enable)
+//
+// Control registers only this driver writes, kept in the shadow cache
+//
+static const unsigned char cached_regs[] = {
+    SM5714_CHG_REG_CNTL1,
+    SM5714_CHG_REG_VBUSCNTL,
+    SM5714_CHG_REG_CHGCNTL2,
+    SM5714_CHG_REG_CHGCNTL4,
+    SM5714_CHG_REG_CHGCNTL5,
+};
+
+void charger_init_cache(_In_ PDEVICE_CONTEXT pDevice)
+{
+    for (unsigned int i = 0; i < ARRAYSIZE(cached_regs); i++)
+        set_reg_cacheable(pDevice, 0, cached_regs[i]);
+}
+
+//
+// Register bits for each setting, shared by the set_* calls and the
+// batched configuration in charger_probe
+//
+static void autostop_bits(bool enable, unsigned char* mask, unsigned char* val)
 {
     // bit 6 controls autostop.
-    unsigned short mask = (0x1 << 6);
-    unsigned short val = (enable ? (0x1 << 6) : 0);
-    return update_reg(pDevice, 0, 0x1A, mask, val);
+    *mask = (0x1 << 6);
+    *val = (enable ? (0x1 << 6) : 0);
 }
 
-int set_input_current_limit(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+static void input_current_limit_bits(unsigned int mA, unsigned char* mask, unsigned char* val)
 {
-    unsigned short mask = 0x7F;  // (0x7F << 0)
-    unsigned short val;
     unsigned char offset;
 
     if (mA < 100)
@@ -32,15 +50,12 @@ int set_input_current_limit(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
     else
         offset = ((mA - 100) / 25) & 0x7F;
 
-    val = offset;  // (offset << 0)
-
-    return update_reg(pDevice, 0, SM5714_CHG_REG_VBUSCNTL, mask, val);
+    *mask = 0x7F;  // (0x7F << 0)
+    *val = offset;  // (offset << 0)
 }
 
-int set_charging_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+static void charging_current_bits(unsigned int mA, unsigned char* mask, unsigned char* val)
 {
-    unsigned short mask = 0xFF;  // (0xFF << 0)
-    unsigned short val;
     unsigned char offset;
     unsigned int uA;
 
@@ -53,15 +68,12 @@ int set_charging_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
     else
         offset = (7 + ((uA - 109375) / 15625)) & 0xFF;
 
-    val = offset;  // (offset << 0)
-
-    return update_reg(pDevice, 0, SM5714_CHG_REG_CHGCNTL2, mask, val);
+    *mask = 0xFF;  // (0xFF << 0)
+    *val = offset;  // (offset << 0)
 }
 
-int set_topoff_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+static void topoff_current_bits(unsigned int mA, unsigned char* mask, unsigned char* val)
 {
-    unsigned short mask = 0x1F;  // (0x1F << 0)
-    unsigned short val;
     unsigned char offset;
 
     if (mA < 100)
@@ -71,33 +83,359 @@ int set_topoff_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
     else
         offset = 0x1C;
 
-    val = offset;  // (offset << 0)
+    *mask = 0x1F;  // (0x1F << 0)
+    *val = offset;  // (offset << 0)
+}
+
+int set_autostop(_In_ PDEVICE_CONTEXT pDevice, bool enable)
+{
+    unsigned char mask;
+    unsigned char val;
+
+    autostop_bits(enable, &mask, &val);
+    return update_reg8(pDevice, 0, SM5714_CHG_REG_CHGCNTL4, mask, val);
+}
+
+int set_input_current_limit(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+{
+    unsigned char mask;
+    unsigned char val;
+
+    input_current_limit_bits(mA, &mask, &val);
+    return update_reg8(pDevice, 0, SM5714_CHG_REG_VBUSCNTL, mask, val);
+}
+
+int set_charging_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+{
+    unsigned char mask;
+    unsigned char val;
+
+    charging_current_bits(mA, &mask, &val);
+    return update_reg8(pDevice, 0, SM5714_CHG_REG_CHGCNTL2, mask, val);
+}
+
+int set_topoff_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA)
+{
+    unsigned char mask;
+    unsigned char val;
+
+    topoff_current_bits(mA, &mask, &val);
+    return update_reg8(pDevice, 0, SM5714_CHG_REG_CHGCNTL5, mask, val);
+}
+
+void charger_config_init(_Out_ CHARGER_CONFIG* config)
+{
+    RtlZeroMemory(config, sizeof(*config));
+}
+
+void charger_config_add(_Inout_ CHARGER_CONFIG* config, unsigned char reg, unsigned char mask, unsigned char val)
+{
+    unsigned long i;
+
+    // Settings sharing a register are merged into one entry
+    for (i = 0; i < config->count; i++)
+    {
+        if (config->reg[i] == reg)
+            break;
+    }
+
+    if (i == config->count)
+    {
+        NT_ASSERT(config->count < CHARGER_CONFIG_MAX_REGS);
+        if (config->count >= CHARGER_CONFIG_MAX_REGS)
+            return;
+
+        config->reg[i] = reg;
+        config->mask[i] = 0;
+        config->val[i] = 0;
+        config->count++;
+    }
+
+    config->mask[i] |= mask;
+    config->val[i] = (config->val[i] & ~mask) | (val & mask);
+}
+
+int charger_config_apply(_In_ PDEVICE_CONTEXT pDevice, _In_ const CHARGER_CONFIG* config)
+{
+    NTSTATUS status;
+    unsigned char current[CHARGER_CONFIG_MAX_REGS];
+    unsigned char changed_reg[CHARGER_CONFIG_MAX_REGS];
+    unsigned char changed_val[CHARGER_CONFIG_MAX_REGS];
+    unsigned long changed = 0;
+
+    // One read for every register not in the shadow cache
+    status = read_regs(pDevice, 0, config->reg, config->count, current);
+    if (!NT_SUCCESS(status))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_INIT, "Error reading charger configuration - %!STATUS!", status);
+        return status;
+    }
 
-    return update_reg(pDevice, 0, SM5714_CHG_REG_CHGCNTL5, mask, val);
+    for (unsigned long i = 0; i < config->count; i++)
+    {
+        unsigned char new_val = (current[i] & ~config->mask[i]) | config->val[i];
+
+        if (new_val != current[i])
+        {
+            changed_reg[changed] = config->reg[i];
+            changed_val[changed] = new_val;
+            changed++;
+        }
+    }
+
+    // Only what changed, in one sequence
+    status = write_regs(pDevice, 0, changed_reg, changed_val, changed);
+    if (!NT_SUCCESS(status))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_INIT, "Error writing charger configuration - %!STATUS!", status);
+    }
+
+    return status;
 }
 
 int charger_probe(_In_ PDEVICE_CONTEXT pDevice)
 {
+    CHARGER_CONFIG config;
+    unsigned char mask;
+    unsigned char val;
+
     // Configure charging parameters
-    set_autostop(pDevice, autostop);
-    set_input_current_limit(pDevice, input_current_limit);
-    set_charging_current(pDevice, charging_current);
-    set_topoff_current(pDevice, topoff_current);
-    return 0; // fix this
+    charger_config_init(&config);
+
+    autostop_bits(autostop, &mask, &val);
+    charger_config_add(&config, SM5714_CHG_REG_CHGCNTL4, mask, val);
+
+    input_current_limit_bits(input_current_limit, &mask, &val);
+    charger_config_add(&config, SM5714_CHG_REG_VBUSCNTL, mask, val);
+
+    charging_current_bits(charging_current, &mask, &val);
+    charger_config_add(&config, SM5714_CHG_REG_CHGCNTL2, mask, val);
+
+    topoff_current_bits(topoff_current, &mask, &val);
+    charger_config_add(&config, SM5714_CHG_REG_CHGCNTL5, mask, val);
+
+    return charger_config_apply(pDevice, &config);
 }
 
 int enable_charging(_In_ PDEVICE_CONTEXT pDevice, bool enable)
 {
-    unsigned short mask = (0x1 << 3);  // mask for bit 3 = 0x08
+    unsigned char mask = (0x1 << 3);  // mask for bit 3 = 0x08
     if (enable) {
-        unsigned short val = (1 << 3);     // Set bit 3 to 1
+        unsigned char val = (1 << 3);     // Set bit 3 to 1
         Print(DEBUG_LEVEL_INFO, DBG_INIT, "Start charging\n");
-        return update_reg(pDevice, 0, SM5714_CHG_REG_CNTL1, mask, val);
+        return update_reg8(pDevice, 0, SM5714_CHG_REG_CNTL1, mask, val);
     }
     else {
-        unsigned short val = 0; // Clear bit 3 to disable charging
+        unsigned char val = 0; // Clear bit 3 to disable charging
         Print(DEBUG_LEVEL_INFO, DBG_INIT, "Stop charging\n");
-        return update_reg(pDevice, 0, SM5714_CHG_REG_CNTL1, mask, val);
+        return update_reg8(pDevice, 0, SM5714_CHG_REG_CNTL1, mask, val);
     }
 
-}
\ No newline at end of file
+}
+
+//
+// Charger interrupt. The ISR runs at PASSIVE_LEVEL, reads INT1..INT5 and
+// STATUS1..STATUS5 and records what was latched and what changed; the work
+// item publishes the change to the requests waiting in ReportQueue. Both
+// are contiguous blocks of 8-bit registers, read as one pointer write plus
+// one burst each in a single sequence. Reading INT1..INT5 clears them,
+// which acknowledges the interrupt in the same sequence.
+//
+
+EVT_WDF_INTERRUPT_ISR charger_evt_interrupt_isr;
+EVT_WDF_INTERRUPT_WORKITEM charger_evt_interrupt_workitem;
+
+C_ASSERT(SM5714_CHG_REG_INT5 - SM5714_CHG_REG_INT1 + 1 == SM5714_CHG_STATUS_COUNT);
+C_ASSERT(SM5714_CHG_REG_STATUS5 - SM5714_CHG_REG_STATUS1 + 1 == SM5714_CHG_STATUS_COUNT);
+
+NTSTATUS charger_create_interrupt(
+    _In_ PDEVICE_CONTEXT pDevice,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated)
+{
+    NTSTATUS status;
+    WDF_INTERRUPT_CONFIG config;
+
+    WDF_INTERRUPT_CONFIG_INIT(&config, charger_evt_interrupt_isr, NULL);
+
+    config.PassiveHandling = TRUE;
+    config.EvtInterruptWorkItem = charger_evt_interrupt_workitem;
+    config.InterruptRaw = InterruptRaw;
+    config.InterruptTranslated = InterruptTranslated;
+
+    status = WdfInterruptCreate(pDevice->FxDevice, &config, WDF_NO_OBJECT_ATTRIBUTES, &pDevice->InterruptObject);
+    if (!NT_SUCCESS(status))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfInterruptCreate failed for charger interrupt 0x%x\n", status);
+        pDevice->InterruptObject = NULL;
+    }
+
+    return status;
+}
+
+NTSTATUS charger_refresh_status(_In_ PDEVICE_CONTEXT pDevice, _Out_opt_ BOOLEAN* pending)
+{
+    NTSTATUS status;
+    unsigned char intr[SM5714_CHG_STATUS_COUNT];
+    unsigned char current[SM5714_CHG_STATUS_COUNT];
+    static const unsigned char regs[] = { SM5714_CHG_REG_INT1, SM5714_CHG_REG_STATUS1 };
+    static const unsigned short lengths[] = { sizeof(intr), sizeof(current) };
+    void* buffers[] = { intr, current };
+    unsigned char any = 0;
+    BOOLEAN moved = FALSE;
+
+    if (pending != NULL)
+        *pending = FALSE;
+
+    // INT1..INT5 and STATUS1..STATUS5 are volatile, read_blocks never
+    // serves them from the shadow cache
+    status = read_blocks(pDevice, 0, regs, buffers, lengths, ARRAYSIZE(regs));
+    if (!NT_SUCCESS(status))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Error reading charger INT1..INT5 and STATUS1..STATUS5 - %!STATUS!", status);
+        return status;
+    }
+
+    WdfWaitLockAcquire(pDevice->DataLock, NULL);
+
+    for (unsigned int i = 0; i < SM5714_CHG_STATUS_COUNT; i++)
+    {
+        unsigned char previous = pDevice->ChargerStatusValid ? pDevice->ChargerStatus.Status[i] : (unsigned char)~current[i];
+
+        pDevice->ChargerStatus.Changed[i] = previous ^ current[i];
+        pDevice->ChargerStatus.Status[i] = current[i];
+        pDevice->ChargerStatus.Interrupt[i] = intr[i];
+
+        if (pDevice->ChargerStatus.Changed[i] != 0)
+            moved = TRUE;
+
+        any |= intr[i];
+    }
+
+    pDevice->ChargerStatusValid = TRUE;
+
+    // A latched event is reported even if STATUS has already settled back
+    if (moved || any != 0)
+        pDevice->ChargerStatus.Sequence++;
+
+    WdfWaitLockRelease(pDevice->DataLock);
+
+    if (pending != NULL)
+        *pending = (any != 0);
+
+    return status;
+}
+
+static VOID charger_complete_status(_In_ PDEVICE_CONTEXT pDevice, _In_ WDFREQUEST Request)
+{
+    NTSTATUS status;
+    SM5714_CHARGER_STATUS* out;
+
+    // Caller holds DataLock
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*out), (PVOID*)&out, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    *out = pDevice->ChargerStatus;
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(*out));
+}
+
+NTSTATUS charger_wait_status(_In_ PDEVICE_CONTEXT pDevice, _In_ WDFREQUEST Request, _Out_ size_t* length)
+{
+    NTSTATUS status;
+    ULONG* seen;
+    SM5714_CHARGER_STATUS* out;
+
+    *length = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(*seen), (PVOID*)&seen, NULL);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*out), (PVOID*)&out, NULL);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    WdfWaitLockAcquire(pDevice->DataLock, NULL);
+
+    if (pDevice->ChargerStatusValid && pDevice->ChargerStatus.Sequence != *seen)
+    {
+        *out = pDevice->ChargerStatus;
+        *length = sizeof(*out);
+    }
+    else
+    {
+        // Parked under DataLock so the work item cannot publish in between
+        status = WdfRequestForwardToIoQueue(Request, pDevice->ReportQueue);
+        if (NT_SUCCESS(status))
+            status = STATUS_PENDING;
+    }
+
+    WdfWaitLockRelease(pDevice->DataLock);
+
+    return status;
+}
+
+VOID charger_complete_waiters(_In_ PDEVICE_CONTEXT pDevice)
+{
+    WDFREQUEST request;
+
+    WdfWaitLockAcquire(pDevice->DataLock, NULL);
+
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(pDevice->ReportQueue, &request)))
+    {
+        charger_complete_status(pDevice, request);
+    }
+
+    WdfWaitLockRelease(pDevice->DataLock);
+}
+
+BOOLEAN charger_evt_interrupt_isr(WDFINTERRUPT Interrupt, ULONG MessageID)
+{
+    PDEVICE_CONTEXT pDevice;
+    BOOLEAN pending;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(MessageID);
+
+    pDevice = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
+
+    // Claimed on the INT bits the read acknowledged, not on STATUS moving
+    status = charger_refresh_status(pDevice, &pending);
+    if (!NT_SUCCESS(status) || !pending)
+        return FALSE;
+
+    WdfInterruptQueueWorkItemForIsr(Interrupt);
+    return TRUE;
+}
+
+VOID charger_evt_interrupt_workitem(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject)
+{
+    PDEVICE_CONTEXT pDevice;
+
+    UNREFERENCED_PARAMETER(Interrupt);
+
+    pDevice = GetDeviceContext((WDFDEVICE)AssociatedObject);
+
+    WdfWaitLockAcquire(pDevice->DataLock, NULL);
+
+    Print(DEBUG_LEVEL_INFO, DBG_IOCTL,
+        "Charger status %lu: %02X %02X %02X %02X %02X changed %02X %02X %02X %02X %02X int %02X %02X %02X %02X %02X\n",
+        pDevice->ChargerStatus.Sequence,
+        pDevice->ChargerStatus.Status[0], pDevice->ChargerStatus.Status[1],
+        pDevice->ChargerStatus.Status[2], pDevice->ChargerStatus.Status[3],
+        pDevice->ChargerStatus.Status[4],
+        pDevice->ChargerStatus.Changed[0], pDevice->ChargerStatus.Changed[1],
+        pDevice->ChargerStatus.Changed[2], pDevice->ChargerStatus.Changed[3],
+        pDevice->ChargerStatus.Changed[4],
+        pDevice->ChargerStatus.Interrupt[0], pDevice->ChargerStatus.Interrupt[1],
+        pDevice->ChargerStatus.Interrupt[2], pDevice->ChargerStatus.Interrupt[3],
+        pDevice->ChargerStatus.Interrupt[4]);
+
+    WdfWaitLockRelease(pDevice->DataLock);
+
+    charger_complete_waiters(pDevice);
+}
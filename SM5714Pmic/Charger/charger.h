@@ -3,12 +3,39 @@
 
 #include "..\Common\driver.h"
 
+//
+// Charger register settings applied together: the target bits of every
+// affected register, computed up front
+//
+#define CHARGER_CONFIG_MAX_REGS 4
+
+typedef struct _CHARGER_CONFIG
+{
+    unsigned long count;
+    unsigned char reg[CHARGER_CONFIG_MAX_REGS];
+    unsigned char mask[CHARGER_CONFIG_MAX_REGS];
+    unsigned char val[CHARGER_CONFIG_MAX_REGS];
+} CHARGER_CONFIG;
+
 // Function prototypes
 int set_autostop(_In_ PDEVICE_CONTEXT pDevice, bool enable);
 int set_input_current_limit(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA);
 int set_charging_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA);
 int set_topoff_current(_In_ PDEVICE_CONTEXT pDevice, unsigned int mA);
+void charger_init_cache(_In_ PDEVICE_CONTEXT pDevice);
+void charger_config_init(_Out_ CHARGER_CONFIG* config);
+void charger_config_add(_Inout_ CHARGER_CONFIG* config, unsigned char reg, unsigned char mask, unsigned char val);
+int charger_config_apply(_In_ PDEVICE_CONTEXT pDevice, _In_ const CHARGER_CONFIG* config);
 int charger_probe(_In_ PDEVICE_CONTEXT pDevice);
 int enable_charging(_In_ PDEVICE_CONTEXT pDevice, bool enable);
 
+// Charger interrupt
+NTSTATUS charger_create_interrupt(
+    _In_ PDEVICE_CONTEXT pDevice,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated);
+NTSTATUS charger_refresh_status(_In_ PDEVICE_CONTEXT pDevice, _Out_opt_ BOOLEAN* pending);
+NTSTATUS charger_wait_status(_In_ PDEVICE_CONTEXT pDevice, _In_ WDFREQUEST Request, _Out_ size_t* length);
+VOID charger_complete_waiters(_In_ PDEVICE_CONTEXT pDevice);
+
 #endif // _CHARGER_H_
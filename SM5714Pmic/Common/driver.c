@@ -60,10 +60,12 @@ Status
 {
     PDEVICE_CONTEXT pDevice = GetDeviceContext(FxDevice);
     NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR chargerInt = NULL;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR chargerIntRaw = NULL;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR pdInt = NULL;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR pdIntRaw = NULL;
     pDevice->SpbContextCount = 0;  // Start with zero IC handles
 
-    UNREFERENCED_PARAMETER(FxResourcesRaw);
-
     //
     // Parse the peripheral's resources.
     //
@@ -107,6 +109,20 @@ Status
 
             pDevice->SpbContextCount++;
         }
+        else if (pDescriptor->Type == CmResourceTypeInterrupt)
+        {
+            // The charger GpioInt comes first, then the USBPD one
+            if (chargerInt == NULL)
+            {
+                chargerInt = pDescriptor;
+                chargerIntRaw = WdfCmResourceListGetDescriptor(FxResourcesRaw, i);
+            }
+            else if (pdInt == NULL)
+            {
+                pdInt = pDescriptor;
+                pdIntRaw = WdfCmResourceListGetDescriptor(FxResourcesRaw, i);
+            }
+        }
     }
 
     // If we never found any IC connections, fail
@@ -114,6 +130,29 @@ Status
     {
         status = STATUS_NOT_FOUND;
     }
+    else if (NT_SUCCESS(status))
+    {
+        // Charger control registers are served from the shadow cache
+        charger_init_cache(pDevice);
+
+        // Without the interrupt charger status is only seen when polled,
+        // so failing to create it is not fatal
+        if (chargerInt != NULL)
+        {
+            charger_create_interrupt(pDevice, chargerIntRaw, chargerInt);
+        }
+
+        // The USBPD block lives on the second SPB context
+        if (pDevice->SpbContextCount > 1)
+        {
+            typec_init(pDevice);
+
+            if (pdInt != NULL)
+            {
+                typec_create_interrupt(pDevice, pdIntRaw, pdInt);
+            }
+        }
+    }
 
     return status;
 }
@@ -150,6 +189,10 @@ Status
 
     pDevice->SpbContextCount = 0;
 
+    // Interrupts created in OnPrepareHardware are deleted by the framework
+    pDevice->InterruptObject = NULL;
+    pDevice->PdInterruptObject = NULL;
+
     return STATUS_SUCCESS;
 }
 
@@ -207,6 +250,28 @@ Status
 		goto exit;
 	}
 
+    RtlZeroMemory(pDevice->PdIntPending, sizeof(pDevice->PdIntPending));
+
+    // Arm DRP toggling and pick up a partner that is already attached
+    if (pDevice->SpbContextCount > 1 && !NT_SUCCESS(typec_start(pDevice)))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Error starting Type-C state machine\n");
+    }
+
+    // Baseline for the charger interrupt, which reports changes against it.
+    // It counts as a change, so requests parked before a power cycle get
+    // the status read after it. It also clears any INT bits latched while
+    // the interrupt was disconnected.
+    pDevice->ChargerStatusValid = FALSE;
+    if (!NT_SUCCESS(charger_refresh_status(pDevice, NULL)))
+    {
+        Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Error reading initial charger status\n");
+    }
+    else
+    {
+        charger_complete_waiters(pDevice);
+    }
+
 exit:
     return status;
 }
@@ -246,6 +311,7 @@ Status
     if (pDevice->DataLock != NULL)
     {
         WdfObjectDelete(pDevice->DataLock);
+        pDevice->DataLock = NULL;
     }
     return status;
 }
@@ -348,6 +414,9 @@ EvtInternalDeviceControl(
     NTSTATUS            status = STATUS_SUCCESS;
     WDFDEVICE           device;
     PDEVICE_CONTEXT     devContext;
+    SPB_STATISTICS*     statistics;
+    size_t              length = 0;
+    ULONG               i;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
@@ -357,12 +426,36 @@ EvtInternalDeviceControl(
 
     switch (IoControlCode)
     {
+    case IOCTL_SM5714PMIC_QUERY_SPB_STATISTICS:
+        length = devContext->SpbContextCount * sizeof(SPB_STATISTICS);
+        status = WdfRequestRetrieveOutputBuffer(Request, length, (PVOID*)&statistics, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            length = 0;
+            break;
+        }
+
+        for (i = 0; i < devContext->SpbContextCount; i++)
+        {
+            SpbQueryStatistics(&devContext->SpbContexts[i], &statistics[i]);
+        }
+        break;
+
+    case IOCTL_SM5714PMIC_WAIT_CHARGER_STATUS:
+        status = charger_wait_status(devContext, Request, &length);
+        if (status == STATUS_PENDING)
+        {
+            // Completed by the charger interrupt work item
+            return;
+        }
+        break;
+
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
     }
 
-    WdfRequestComplete(Request, status);
+    WdfRequestCompleteWithInformation(Request, status, length);
 
     return;
 }
\ No newline at end of file
@@ -16,6 +16,7 @@
 #include <ntstrsafe.h>
 
 #include "spb.h"
+#include "..\TypeC\typec_sm.h"
 
 //
 // String definitions
@@ -30,6 +31,61 @@
 #define true 1
 #define false 0
 
+//
+// Internal IOCTL returning one SPB_STATISTICS per SPB context, in the
+// order of DEVICE_CONTEXT::SpbContexts
+//
+
+#define IOCTL_SM5714PMIC_QUERY_SPB_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Charger STATUS1..STATUS5 as last read by the charger interrupt. Changed
+// holds the bits that moved with that read and Interrupt the INT1..INT5
+// bits it acknowledged, Sequence counts the reads that reported either.
+//
+
+#define SM5714_CHG_STATUS_COUNT 5
+
+typedef struct _SM5714_CHARGER_STATUS
+{
+    ULONG Sequence;
+    UCHAR Status[SM5714_CHG_STATUS_COUNT];
+    UCHAR Changed[SM5714_CHG_STATUS_COUNT];
+    UCHAR Interrupt[SM5714_CHG_STATUS_COUNT];
+} SM5714_CHARGER_STATUS;
+
+//
+// Internal IOCTL returning SM5714_CHARGER_STATUS. Input is the last
+// Sequence the caller has seen; the request stays pending until the
+// charger status moves past it.
+//
+
+#define IOCTL_SM5714PMIC_WAIT_CHARGER_STATUS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// USBPD interrupt and status blocks, INT1..INT5 and STATUS1..STATUS5
+//
+
+#define SM5714_USBPD_INT_COUNT 5
+
+//
+// A received USB-PD message as laid out in the USBPD block: RX_SRC,
+// RX_HEADER_00/01 and the data objects from RX_PAYLOAD. The receive path
+// reads the registers straight into a ring slot of this layout.
+//
+
+#define SM5714_PD_MAX_DATA_OBJECTS 7
+#define SM5714_PD_RX_RING_SIZE 8
+
+typedef struct _SM5714_PD_MESSAGE
+{
+    UCHAR Source;
+    UCHAR Header[2];
+    UCHAR Payload[SM5714_PD_MAX_DATA_OBJECTS * 4];
+} SM5714_PD_MESSAGE;
+
 typedef struct _DEVICE_CONTEXT
 {
 
@@ -41,6 +97,29 @@ typedef struct _DEVICE_CONTEXT
 	BOOLEAN DevicePoweredOn;
 	WDFWAITLOCK DataLock;
 
+	// Published charger status, protected by DataLock. Waiters for the
+	// next change are parked in ReportQueue.
+	SM5714_CHARGER_STATUS ChargerStatus;
+	BOOLEAN ChargerStatusValid;
+
+	// USBPD interrupt on the second SPB context. The ISR accumulates the
+	// INT bits it acknowledged in PdIntPending and the latest STATUS block
+	// in PdStatus, both protected by DataLock, for the work item.
+	WDFINTERRUPT PdInterruptObject;
+	UCHAR PdIntPending[SM5714_USBPD_INT_COUNT];
+	UCHAR PdStatus[SM5714_USBPD_INT_COUNT];
+
+	// Type-C state machine, only run from the USBPD work item and D0 entry
+	TYPEC_PORT TypeC;
+
+	// Received PD messages. The receive path fills the slot at PdRxHead,
+	// the policy engine consumes from PdRxTail; both free-run and are
+	// reduced modulo SM5714_PD_RX_RING_SIZE.
+	SM5714_PD_MESSAGE PdRxRing[SM5714_PD_RX_RING_SIZE];
+	volatile LONG PdRxHead;
+	volatile LONG PdRxTail;
+	ULONG PdRxDropped;
+
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, GetDeviceContext)
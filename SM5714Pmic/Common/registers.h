@@ -4,6 +4,14 @@
 //
 // Charger Register definitions
 //
+enum chg_int_regs {
+    SM5714_CHG_REG_INT1         = 0x01,
+    SM5714_CHG_REG_INT2         = 0x02,
+    SM5714_CHG_REG_INT3         = 0x03,
+    SM5714_CHG_REG_INT4         = 0x04,
+    SM5714_CHG_REG_INT5         = 0x05,
+};
+
 enum chg_status_regs {
     SM5714_CHG_REG_STATUS1      = 0x0D,
     SM5714_CHG_REG_STATUS2      = 0x0E,
@@ -104,4 +112,64 @@ enum typec_usbpd_reg {
 	SM5714_REG_PD_STATE5 = 0xDA
 };
 
+//
+// USBPD register bits. The INT1..INT5 and STATUS1..STATUS5 blocks and the
+// control registers below are 8 bits wide.
+//
+
+// INT1 / STATUS1
+#define SM5714_REG_INT_STATUS1_VBUSPOK      (1 << 0)
+#define SM5714_REG_INT_STATUS1_TMR_EXP      (1 << 1)
+#define SM5714_REG_INT_STATUS1_ABNORMAL_DEV (1 << 2)
+#define SM5714_REG_INT_STATUS1_DETACH       (1 << 3)
+#define SM5714_REG_INT_STATUS1_ATTACH       (1 << 4)
+
+// CC_STATUS
+#define SM5714_ATTACH_TYPE                  0x07
+#define SM5714_ATTACH_NONE                  0x00
+#define SM5714_ATTACH_SOURCE                0x01    // Partner is a sink, we source
+#define SM5714_ATTACH_SINK                  0x02    // Partner is a source, we sink
+#define SM5714_ATTACH_AUDIO                 0x03
+#define SM5714_ATTACH_DEBUG                 0x04
+#define SM5714_CABLE_FLIP                   (1 << 3)
+
+// CC_CNTL1
+#define SM5714_CC_OP_MODE_MASK              0x03
+#define SM5714_CC_OP_MODE_SNK               0x00
+#define SM5714_CC_OP_MODE_SRC               0x02
+#define SM5714_CC_OP_MODE_DRP               0x01
+
+// JIGON_CONTROL
+#define SM5714_JIGON_ON                     (1 << 0)
+#define SM5714_JIGON_MANUAL                 (1 << 1)
+
+// PD_CNTL1
+#define SM5714_PD_CNTL1_ENABLE              (1 << 0)
+
+// INT4 / STATUS4
+#define SM5714_REG_INT_STATUS4_RX_DONE      (1 << 0)
+
+//
+// USB-PD message header (RX_HEADER_01:RX_HEADER_00)
+//
+#define PD_HEADER_MESSAGE_TYPE(h)           ((h) & 0x1F)
+#define PD_HEADER_DATA_ROLE(h)              (((h) >> 5) & 0x1)
+#define PD_HEADER_SPEC_REV(h)               (((h) >> 6) & 0x3)
+#define PD_HEADER_POWER_ROLE(h)             (((h) >> 8) & 0x1)
+#define PD_HEADER_MESSAGE_ID(h)             (((h) >> 9) & 0x7)
+#define PD_HEADER_DATA_OBJECTS(h)           (((h) >> 12) & 0x7)
+#define PD_HEADER_EXTENDED(h)               (((h) >> 15) & 0x1)
+
+// Data message types
+#define PD_DATA_SOURCE_CAPABILITIES         0x01
+#define PD_DATA_REQUEST                     0x02
+#define PD_DATA_SINK_CAPABILITIES           0x04
+#define PD_DATA_VENDOR_DEFINED              0x0F
+
+// Fixed supply PDO
+#define PD_PDO_TYPE(p)                      (((p) >> 30) & 0x3)
+#define PD_PDO_TYPE_FIXED                   0x0
+#define PD_PDO_FIXED_VOLTAGE_MV(p)          ((((p) >> 10) & 0x3FF) * 50)
+#define PD_PDO_FIXED_CURRENT_MA(p)          (((p) & 0x3FF) * 10)
+
 #endif
\ No newline at end of file
@@ -27,6 +27,130 @@ static ULONG DebugLevel = 100;
 static ULONG DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 #define I2C_VERBOSE_LOGGING 1
 
+LARGE_INTEGER
+SpbStatisticsStart(
+	VOID
+)
+/*++
+
+Routine Description:
+
+This helper routine timestamps the start of a transfer for
+SpbStatisticsRecord.
+
+Return Value:
+
+The performance counter
+
+--*/
+{
+	return KeQueryPerformanceCounter(NULL);
+}
+
+VOID
+SpbStatisticsRecord(
+	_In_ SPB_CONTEXT* SpbContext,
+	_In_ LARGE_INTEGER StartTime,
+	_In_ ULONG Bytes,
+	_In_ NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+This helper routine accounts one bus transfer in the context's
+statistics and latency histogram.
+
+Arguments:
+
+SpbContext - Pointer to the current device context
+StartTime  - The value returned by SpbStatisticsStart
+Bytes      - The number of bytes moved over the bus
+Status     - The status of the transfer
+
+Return Value:
+
+None
+
+--*/
+{
+	SPB_STATISTICS* statistics = &SpbContext->Statistics;
+	LARGE_INTEGER endTime;
+	ULONGLONG elapsedUs;
+	ULONG bucket;
+
+	endTime = KeQueryPerformanceCounter(NULL);
+	elapsedUs = ((ULONGLONG)(endTime.QuadPart - StartTime.QuadPart) * 1000000) /
+		(ULONGLONG)SpbContext->PerformanceFrequency.QuadPart;
+
+	if (elapsedUs < 2)
+	{
+		bucket = 0;
+	}
+	else if (elapsedUs > MAXULONG)
+	{
+		bucket = SPB_LATENCY_BUCKETS - 1;
+	}
+	else
+	{
+		_BitScanReverse(&bucket, (ULONG)elapsedUs);
+		bucket = min(bucket, SPB_LATENCY_BUCKETS - 1);
+	}
+
+	InterlockedIncrement64((volatile LONG64*)&statistics->Transfers);
+	InterlockedAdd64((volatile LONG64*)&statistics->Bytes, Bytes);
+	InterlockedAdd64((volatile LONG64*)&statistics->BusTimeUs, (LONG64)elapsedUs);
+	InterlockedIncrement64((volatile LONG64*)&statistics->LatencyBuckets[bucket]);
+
+	if (!NT_SUCCESS(Status))
+	{
+		InterlockedIncrement64((volatile LONG64*)&statistics->Errors);
+
+		if (Status == STATUS_IO_TIMEOUT)
+		{
+			InterlockedIncrement64((volatile LONG64*)&statistics->Timeouts);
+		}
+	}
+}
+
+VOID
+SpbQueryStatistics(
+	_In_ SPB_CONTEXT* SpbContext,
+	_Out_ SPB_STATISTICS* Statistics
+)
+/*++
+
+Routine Description:
+
+This routine copies the transfer statistics. Each counter is read
+atomically; the copy as a whole is not a consistent snapshot.
+
+Arguments:
+
+SpbContext - Pointer to the current device context
+Statistics - Receives the statistics
+
+Return Value:
+
+None
+
+--*/
+{
+	SPB_STATISTICS* source = &SpbContext->Statistics;
+	ULONG i;
+
+	Statistics->Transfers = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Transfers);
+	Statistics->Bytes = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Bytes);
+	Statistics->Errors = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Errors);
+	Statistics->Timeouts = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->Timeouts);
+	Statistics->BusTimeUs = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->BusTimeUs);
+
+	for (i = 0; i < SPB_LATENCY_BUCKETS; i++)
+	{
+		Statistics->LatencyBuckets[i] = (ULONGLONG)ReadNoFence64((volatile LONG64*)&source->LatencyBuckets[i]);
+	}
+}
+
 NTSTATUS
 SpbDoWriteDataSynchronously(
 	IN SPB_CONTEXT* SpbContext,
@@ -57,6 +181,9 @@ NTSTATUS Status indicating success or failure
 	ULONG length;
 	WDFMEMORY memory;
 	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	LARGE_INTEGER busStart;
+	ULONG_PTR bytesWritten = 0;
 	NTSTATUS status;
 
 	length = Length;
@@ -95,13 +222,20 @@ NTSTATUS Status indicating success or failure
 
 	RtlCopyMemory(buffer, Data, length);
 
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+	sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(SPB_TRANSFER_TIMEOUT_US);
+
+	busStart = SpbStatisticsStart();
+
 	status = WdfIoTargetSendWriteSynchronously(
 		SpbContext->SpbIoTarget,
 		NULL,
 		&memoryDescriptor,
 		NULL,
-		NULL,
-		NULL);
+		&sendOptions,
+		&bytesWritten);
+
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytesWritten, status);
 
 	if (!NT_SUCCESS(status))
 	{
@@ -204,6 +338,9 @@ NTSTATUS Status indicating success or failure
 	ULONG length;
 	WDFMEMORY memory;
 	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	LARGE_INTEGER busStart;
+	ULONG_PTR bytesWritten = 0;
 	NTSTATUS status;
 
 	length = Length + Length2;
@@ -243,13 +380,20 @@ NTSTATUS Status indicating success or failure
 	RtlCopyMemory(buffer, Data, Length);
 	RtlCopyMemory(buffer+Length, Data2, Length2);
 
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+	sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(SPB_TRANSFER_TIMEOUT_US);
+
+	busStart = SpbStatisticsStart();
+
 	status = WdfIoTargetSendWriteSynchronously(
 		SpbContext->SpbIoTarget,
 		NULL,
 		&memoryDescriptor,
 		NULL,
-		NULL,
-		NULL);
+		&sendOptions,
+		&bytesWritten);
+
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytesWritten, status);
 
 	if (!NT_SUCCESS(status))
 	{
@@ -318,7 +462,7 @@ _SpbSequence(
 	_In_reads_(SequenceLength)  PVOID        Sequence,
 	_In_                        SIZE_T       SequenceLength,
 	_Out_                       PULONG       BytesReturned,
-	_In_                        ULONG        Timeout
+	_In_                        ULONG        TimeoutUs
 )
 /*++
 
@@ -329,9 +473,8 @@ _SpbSequence(
 	Sequence        - Pointer to a list of sequence transfers
 	SequenceLength  - Length of sequence transfers
 	BytesReturned   - The number of bytes transferred in the actual transaction
-	Timeout         - The timeout associated with this transfer
-						Default is HIDI2C_REQUEST_DEFAULT_TIMEOUT second
-						0 means no timeout
+	TimeoutUs       - The timeout associated with this transfer in
+						microseconds, 0 means no timeout
   Return Value:
 	NTSTATUS Status indicating success or failure
 --*/
@@ -367,8 +510,9 @@ _SpbSequence(
 		NULL);
 
 	ULONG_PTR bytes = 0;
+	LARGE_INTEGER busStart = SpbStatisticsStart();
 
-	if (Timeout == 0)
+	if (TimeoutUs == 0)
 	{
 		//
 		// Send the SPB sequence IOCTL without a timeout set
@@ -390,7 +534,7 @@ _SpbSequence(
 		//
 		WDF_REQUEST_SEND_OPTIONS sendOptions;
 		WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
-		sendOptions.Timeout = WDF_REL_TIMEOUT_IN_SEC(Timeout);
+		sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(TimeoutUs);
 
 		//
 		// Send the SPB sequence IOCTL.
@@ -406,6 +550,8 @@ _SpbSequence(
 			&bytes);
 	}
 
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytes, status);
+
 	if (!NT_SUCCESS(status))
 	{
 		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Failed sending SPB Sequence IOCTL bytes:%lu status:%!STATUS!", (ULONG)bytes, status);
@@ -523,7 +669,7 @@ SpbWriteRead(
 	// Send the read as a Sequence request to the SPB target
 	// 
 	ULONG bytesReturned = 0;
-	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, 100);
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
 
 	if (!NT_SUCCESS(status))
 	{
@@ -566,6 +712,302 @@ exit:
 	return status;
 }
 
+NTSTATUS
+SpbReadRegisters(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Registers,
+	_In_                            ULONG           Count,
+	_Out_writes_bytes_(Count * Length) PVOID        Data,
+	_In_                            USHORT          Length
+)
+/*++
+
+  Routine Description:
+	This routine reads several registers in a single sequence request,
+	one register pointer write and one read per register
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Registers               The register addresses to read
+	Count                   The number of registers, at most SPB_MAX_SEQUENCE_REGISTERS
+	Data                    Receives Length bytes per register, in order
+	Length                  The number of bytes read from each register
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	ULONG i;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	if (Registers == NULL || Data == NULL || Length == 0 ||
+		Count == 0 || Count > SPB_MAX_SEQUENCE_REGISTERS)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbReadRegisters failed parameters Registers:%p Count:%lu "
+			"Data:%p Length:%lu status:%!STATUS!",
+			Registers,
+			Count,
+			Data,
+			Length,
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Build the SPB sequence
+	//
+	SPB_TRANSFER_LIST_AND_ENTRIES(SPB_MAX_SEQUENCE_REGISTERS * 2)    sequence;
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), Count * 2);
+
+	for (i = 0; i < Count; i++)
+	{
+		//
+		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+		// "struct hack" size but using an index variable quiets 
+		// the warning. This is a false positive from OACR.
+		// 
+
+		ULONG index = i * 2;
+
+		sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionToDevice,
+			0,
+			(PVOID)&Registers[i],
+			sizeof(UCHAR));
+
+		sequence.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			0,
+			(PUCHAR)Data + i * Length,
+			Length);
+	}
+
+	ULONG bytesReturned = 0;
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
+
+	if (!NT_SUCCESS(status))
+	{
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "SpbSequence failed sending a sequence " "status:%!STATUS!", status);
+		goto exit;
+	}
+
+	ULONG expectedLength = Count * (sizeof(UCHAR) + Length);
+	if (bytesReturned < expectedLength)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbSequence returned with 0x%lu bytes expected:0x%lu bytes "
+			"status:%!STATUS!",
+			bytesReturned,
+			expectedLength,
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	return status;
+}
+
+NTSTATUS
+SpbReadBlocks(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Registers,
+	_In_reads_(Count)               PVOID*          Buffers,
+	_In_reads_(Count)               const USHORT*   Lengths,
+	_In_                            ULONG           Count
+)
+/*++
+
+  Routine Description:
+	This routine reads several register blocks of different lengths in a
+	single sequence request, straight into the caller's buffers
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Registers               The first register of each block
+	Buffers                 Receives each block
+	Lengths                 The length of each block
+	Count                   The number of blocks, at most SPB_MAX_SEQUENCE_REGISTERS
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	ULONG expectedLength = 0;
+	ULONG i;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	if (Registers == NULL || Buffers == NULL || Lengths == NULL ||
+		Count == 0 || Count > SPB_MAX_SEQUENCE_REGISTERS)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbReadBlocks failed parameters Registers:%p Count:%lu "
+			"status:%!STATUS!",
+			Registers,
+			Count,
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Build the SPB sequence
+	//
+	SPB_TRANSFER_LIST_AND_ENTRIES(SPB_MAX_SEQUENCE_REGISTERS * 2)    sequence;
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), Count * 2);
+
+	for (i = 0; i < Count; i++)
+	{
+		//
+		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+		// "struct hack" size but using an index variable quiets 
+		// the warning. This is a false positive from OACR.
+		// 
+
+		ULONG index = i * 2;
+
+		sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionToDevice,
+			0,
+			(PVOID)&Registers[i],
+			sizeof(UCHAR));
+
+		sequence.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			0,
+			Buffers[i],
+			Lengths[i]);
+
+		expectedLength += sizeof(UCHAR) + Lengths[i];
+	}
+
+	ULONG bytesReturned = 0;
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
+
+	if (!NT_SUCCESS(status))
+	{
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "SpbSequence failed sending a sequence " "status:%!STATUS!", status);
+		goto exit;
+	}
+
+	if (bytesReturned < expectedLength)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbSequence returned with 0x%lu bytes expected:0x%lu bytes "
+			"status:%!STATUS!",
+			bytesReturned,
+			expectedLength,
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	return status;
+}
+
+NTSTATUS
+SpbWriteMultiple(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_bytes_(Count * Stride) PVOID          Data,
+	_In_                            ULONG           Count,
+	_In_                            USHORT          Stride
+)
+/*++
+
+  Routine Description:
+	This routine sends several register writes in a single sequence
+	request. Data holds Count writes of Stride bytes each, every one
+	starting with its register address; each goes out as its own
+	transfer with a restart in between.
+  Arguments:
+	SpbContext      -       Pointer to the current device context
+	Data                    The writes, back to back
+	Count                   The number of writes, at most SPB_MAX_SEQUENCE_REGISTERS
+	Stride                  The length of each write
+  Return Value:
+	NTSTATUS Status indicating success or failure
+--*/
+{
+	NTSTATUS status;
+	ULONG i;
+
+	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	if (Data == NULL || Stride == 0 ||
+		Count == 0 || Count > SPB_MAX_SEQUENCE_REGISTERS)
+	{
+		status = STATUS_INVALID_PARAMETER;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbWriteMultiple failed parameters Data:%p Count:%lu Stride:%lu "
+			"status:%!STATUS!",
+			Data,
+			Count,
+			Stride,
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Build the SPB sequence
+	//
+	SPB_TRANSFER_LIST_AND_ENTRIES(SPB_MAX_SEQUENCE_REGISTERS)    sequence;
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), Count);
+
+	for (i = 0; i < Count; i++)
+	{
+		//
+		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+		// "struct hack" size but using an index variable quiets 
+		// the warning. This is a false positive from OACR.
+		// 
+
+		ULONG index = i;
+
+		sequence.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionToDevice,
+			0,
+			(PUCHAR)Data + i * Stride,
+			Stride);
+	}
+
+	ULONG bytesReturned = 0;
+	status = _SpbSequence(SpbContext, &sequence, sizeof(sequence), &bytesReturned, SPB_TRANSFER_TIMEOUT_US);
+
+	if (!NT_SUCCESS(status))
+	{
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "SpbSequence failed sending a sequence " "status:%!STATUS!", status);
+		goto exit;
+	}
+
+	ULONG expectedLength = Count * Stride;
+	if (bytesReturned < expectedLength)
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"SpbSequence returned with 0x%lu bytes expected:0x%lu bytes "
+			"status:%!STATUS!",
+			bytesReturned,
+			expectedLength,
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	return status;
+}
+
 NTSTATUS
 SpbXferDataSynchronously(
 	_In_ SPB_CONTEXT* SpbContext,
@@ -590,6 +1032,8 @@ NTSTATUS Status indicating success or failure
 	PUCHAR buffer;
 	WDFMEMORY memory;
 	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_REQUEST_SEND_OPTIONS sendOptions;
+	LARGE_INTEGER busStart;
 	NTSTATUS status;
 	ULONG_PTR bytesRead;
 
@@ -645,14 +1089,21 @@ NTSTATUS Status indicating success or failure
 	}
 
 
+	WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+	sendOptions.Timeout = WDF_REL_TIMEOUT_IN_US(SPB_TRANSFER_TIMEOUT_US);
+
+	busStart = SpbStatisticsStart();
+
 	status = WdfIoTargetSendReadSynchronously(
 		SpbContext->SpbIoTarget,
 		NULL,
 		&memoryDescriptor,
 		NULL,
-		NULL,
+		&sendOptions,
 		&bytesRead);
 
+	SpbStatisticsRecord(SpbContext, busStart, (ULONG)bytesRead, status);
+
 	if (!NT_SUCCESS(status) ||
 		bytesRead != Length)
 	{
@@ -752,6 +1203,15 @@ NTSTATUS Status indicating success or failure
 	WCHAR spbDeviceNameBuffer[RESOURCE_HUB_PATH_SIZE];
 	NTSTATUS status;
 
+	KeQueryPerformanceCounter(&SpbContext->PerformanceFrequency);
+
+	//
+	// Registers may have changed while the target was closed, start with
+	// an empty shadow cache
+	//
+	RtlZeroMemory(SpbContext->ShadowCacheable, sizeof(SpbContext->ShadowCacheable));
+	RtlZeroMemory(SpbContext->ShadowValid, sizeof(SpbContext->ShadowValid));
+
 	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
 	objectAttributes.ParentObject = FxDevice;
 
@@ -26,9 +26,62 @@ Revision History:
 #define DEFAULT_SPB_BUFFER_SIZE 64
 #define RESHUB_USE_HELPER_ROUTINES
 
+//
+// Transfer deadline. Every transfer is cancelled after
+// SPB_TRANSFER_TIMEOUT_US, well inside the USB-PD response windows the
+// interrupt and RX paths have to meet.
+//
+#define SPB_TRANSFER_TIMEOUT_US 10000
+
+//
+// Cumulative transfer statistics. Errors includes Timeouts. Latency is
+// bucketed by powers of two in microseconds: bucket 0 counts transfers
+// faster than 2 us, bucket n those taking [2^n, 2^(n+1)) us and the last
+// bucket everything slower.
+//
+
+#define SPB_LATENCY_BUCKETS 20
+
+//
+// Register address space covered by the shadow cache, one bit per register
+// in the cacheable and valid bitmaps
+//
+
+#define SPB_SHADOW_REGISTERS 256
+
+//
+// Most registers SpbReadRegisters and SpbWriteMultiple handle in one
+// sequence
+//
+
+#define SPB_MAX_SEQUENCE_REGISTERS 8
+
+typedef struct _SPB_STATISTICS
+{
+	ULONGLONG Transfers;
+	ULONGLONG Bytes;
+	ULONGLONG Errors;
+	ULONGLONG Timeouts;
+	ULONGLONG BusTimeUs;
+	ULONGLONG LatencyBuckets[SPB_LATENCY_BUCKETS];
+} SPB_STATISTICS;
+
 //
 // SPB (I2C) context
 //
+// Unlike the battery driver, there is no submission queue combining reads
+// from different callers. Each context is a separate I2C target with
+// little contention on it: the charger context is used by D0 entry, which
+// runs before the interrupt is connected, and by the charger ISR, which
+// WDF does not run concurrently with itself. The USBPD context is shared
+// by its ISR and the Type-C state machine in the work item, whose reads
+// and read-modify-writes each depend on the result of the one before, so
+// there is nothing to merge them with. Each caller instead batches its own
+// accesses: the ISRs read INT
+// and STATUS with one SpbReadBlocks sequence, the RX path reads a whole
+// message with one, and D0 entry reads and writes the charger
+// configuration with one SpbReadRegisters and one SpbWriteMultiple.
+//
 
 typedef struct _SPB_CONTEXT
 {
@@ -37,6 +90,23 @@ typedef struct _SPB_CONTEXT
 	WDFMEMORY WriteMemory;
 	WDFMEMORY ReadMemory;
 	WDFWAITLOCK SpbLock;
+
+	//
+	// Transfer statistics, updated with interlocked operations.
+	// PerformanceFrequency converts KeQueryPerformanceCounter ticks.
+	//
+	SPB_STATISTICS Statistics;
+	LARGE_INTEGER PerformanceFrequency;
+
+	//
+	// Shadow copies of registers only the driver changes, one byte per
+	// 8-bit register, maintained by the spbhelper accessors.
+	// ShadowCacheable marks those registers, ShadowValid the ones whose
+	// shadow matches the device.
+	//
+	UCHAR ShadowValues[SPB_SHADOW_REGISTERS];
+	LONG ShadowCacheable[SPB_SHADOW_REGISTERS / 32];
+	LONG ShadowValid[SPB_SHADOW_REGISTERS / 32];
 } SPB_CONTEXT;
 
 NTSTATUS
@@ -49,6 +119,32 @@ SpbWriteRead(
 	_In_                            ULONG           DelayUs
 );
 
+NTSTATUS
+SpbReadRegisters(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Registers,
+	_In_                            ULONG           Count,
+	_Out_writes_bytes_(Count * Length) PVOID        Data,
+	_In_                            USHORT          Length
+);
+
+NTSTATUS
+SpbReadBlocks(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_(Count)               const UCHAR*    Registers,
+	_In_reads_(Count)               PVOID*          Buffers,
+	_In_reads_(Count)               const USHORT*   Lengths,
+	_In_                            ULONG           Count
+);
+
+NTSTATUS
+SpbWriteMultiple(
+	_In_                            SPB_CONTEXT*    SpbContext,
+	_In_reads_bytes_(Count * Stride) PVOID          Data,
+	_In_                            ULONG           Count,
+	_In_                            USHORT          Stride
+);
+
 NTSTATUS
 SpbXferDataSynchronously(
 	_In_ SPB_CONTEXT* SpbContext,
@@ -58,6 +154,12 @@ SpbXferDataSynchronously(
 	_In_ ULONG Length
 );
 
+VOID
+SpbQueryStatistics(
+	_In_ SPB_CONTEXT* SpbContext,
+	_Out_ SPB_STATISTICS* Statistics
+);
+
 VOID
 SpbTargetDeinitialize(
 	IN WDFDEVICE FxDevice,
@@ -1,5 +1,85 @@
 #include "spbhelper.h"
 
+//
+// Shadow cache of registers only the driver changes. The registers are 8
+// bits wide, so the shadow keeps one byte per register; a 16-bit access
+// covers reg and reg + 1 and is served from the shadow only when both
+// bytes are. Reads of a cacheable register are served from its shadow
+// once a read or write has filled it, so update_reg8 costs one write or
+// nothing. Volatile registers (status, interrupt) are never marked
+// cacheable and always go to the bus.
+//
+
+static BOOLEAN shadow_bit(const volatile LONG* bitmap, unsigned char reg)
+{
+    return (BOOLEAN)((ReadAcquire(&bitmap[reg / 32]) >> (reg % 32)) & 1);
+}
+
+static BOOLEAN shadow_lookup(SPB_CONTEXT* spbCtx, unsigned char reg, unsigned char* data)
+{
+    if (!shadow_bit(spbCtx->ShadowValid, reg))
+    {
+        return FALSE;
+    }
+
+    *data = spbCtx->ShadowValues[reg];
+    return TRUE;
+}
+
+static VOID shadow_store(SPB_CONTEXT* spbCtx, unsigned char reg, unsigned char data)
+{
+    if (!shadow_bit(spbCtx->ShadowCacheable, reg))
+    {
+        return;
+    }
+
+    spbCtx->ShadowValues[reg] = data;
+    InterlockedBitTestAndSet(&spbCtx->ShadowValid[reg / 32], reg % 32);
+}
+
+static VOID shadow_invalidate(SPB_CONTEXT* spbCtx, unsigned char reg)
+{
+    InterlockedBitTestAndReset(&spbCtx->ShadowValid[reg / 32], reg % 32);
+}
+
+// 16-bit accesses, LSB in reg and MSB in the register after it
+static BOOLEAN shadow_lookup16(SPB_CONTEXT* spbCtx, unsigned char reg, unsigned short* data)
+{
+    unsigned char lo;
+    unsigned char hi;
+
+    if (!shadow_lookup(spbCtx, reg, &lo) ||
+        !shadow_lookup(spbCtx, (unsigned char)(reg + 1), &hi))
+    {
+        return FALSE;
+    }
+
+    *data = ((unsigned short)hi << 8) | lo;
+    return TRUE;
+}
+
+static VOID shadow_store16(SPB_CONTEXT* spbCtx, unsigned char reg, unsigned short data)
+{
+    shadow_store(spbCtx, reg, data & 0xFF);
+    shadow_store(spbCtx, (unsigned char)(reg + 1), (data >> 8) & 0xFF);
+}
+
+static VOID shadow_invalidate16(SPB_CONTEXT* spbCtx, unsigned char reg)
+{
+    shadow_invalidate(spbCtx, reg);
+    shadow_invalidate(spbCtx, (unsigned char)(reg + 1));
+}
+
+VOID set_reg_cacheable(
+    PDEVICE_CONTEXT pDevice,
+    unsigned long   spbIndex,
+    unsigned char   reg
+)
+{
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+    InterlockedBitTestAndSet(&spbCtx->ShadowCacheable[reg / 32], reg % 32);
+}
+
 NTSTATUS write_reg(
     PDEVICE_CONTEXT pDevice,
     unsigned long   spbIndex,
@@ -15,7 +95,16 @@ NTSTATUS write_reg(
     buf[1] = data & 0xFF;
     buf[2] = (data >> 8) & 0xFF;
     SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
-    return SpbWriteDataSynchronously(spbCtx, buf, sizeof(buf));
+    NTSTATUS status = SpbWriteDataSynchronously(spbCtx, buf, sizeof(buf));
+
+    // The write covers reg + 1 as well; a failed one leaves both in an
+    // unknown state
+    if (NT_SUCCESS(status))
+        shadow_store16(spbCtx, reg, data);
+    else
+        shadow_invalidate16(spbCtx, reg);
+
+    return status;
 }
 
 NTSTATUS read_reg(
@@ -29,10 +118,175 @@ NTSTATUS read_reg(
     unsigned char read_buf[2];
 
     SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+    if (shadow_lookup16(spbCtx, reg, data))
+        return STATUS_SUCCESS;
+
     status = SpbWriteRead(spbCtx, &reg_addr, sizeof(reg_addr), read_buf, sizeof(read_buf), 0);
 
     // Combine 2 bytes into a 16-bit (LSB first)
     *data = ((unsigned short)read_buf[1] << 8) | read_buf[0];
+
+    if (NT_SUCCESS(status))
+        shadow_store16(spbCtx, reg, *data);
+
+    return status;
+}
+
+NTSTATUS read_block(
+    PDEVICE_CONTEXT pDevice,
+    unsigned long   spbIndex,
+    unsigned char   reg,    // First register of the block
+    unsigned char*  data,   // Read length bytes
+    unsigned short  length
+)
+{
+    unsigned char reg_addr = reg;
+
+    // One pointer write and one read; the device walks the address
+    // forward through the block. Never served from the shadow cache.
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+    return SpbWriteRead(spbCtx, &reg_addr, sizeof(reg_addr), data, length, 0);
+}
+
+NTSTATUS read_blocks(
+    PDEVICE_CONTEXT       pDevice,
+    unsigned long         spbIndex,
+    const unsigned char*  regs,     // First register of each block
+    void**                buffers,  // Destination of each block
+    const unsigned short* lengths,
+    unsigned long         count
+)
+{
+    // All blocks in one sequence, read in place. Never served from the
+    // shadow cache.
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+    return SpbReadBlocks(spbCtx, regs, buffers, lengths, count);
+}
+
+NTSTATUS update_reg8(
+    PDEVICE_CONTEXT pDevice,
+    unsigned long   spbIndex,
+    unsigned char   reg,
+    unsigned char   mask,
+    unsigned char   val)
+{
+    NTSTATUS status;
+    unsigned char current;
+    unsigned char buf[2];
+
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+
+    // Read-modify-write of a single 8-bit register, leaving its neighbour
+    // alone. The read comes from the shadow cache if it has one.
+    if (!shadow_lookup(spbCtx, reg, &current))
+    {
+        status = read_block(pDevice, spbIndex, reg, &current, sizeof(current));
+        if (!NT_SUCCESS(status))
+            return status;
+
+        shadow_store(spbCtx, reg, current);
+    }
+
+    buf[0] = reg;
+    buf[1] = (current & ~mask) | (val & mask);
+
+    if (buf[1] == current)
+        return STATUS_SUCCESS;
+
+    status = SpbWriteDataSynchronously(spbCtx, buf, sizeof(buf));
+
+    // A failed write leaves the register in an unknown state
+    if (NT_SUCCESS(status))
+        shadow_store(spbCtx, reg, buf[1]);
+    else
+        shadow_invalidate(spbCtx, reg);
+
+    return status;
+}
+
+NTSTATUS read_regs(
+    PDEVICE_CONTEXT      pDevice,
+    unsigned long        spbIndex,
+    const unsigned char* regs,
+    unsigned long        count,
+    unsigned char*       data
+)
+{
+    NTSTATUS status;
+    unsigned char missing[SPB_MAX_SEQUENCE_REGISTERS];
+    unsigned long slot[SPB_MAX_SEQUENCE_REGISTERS];
+    unsigned char read_buf[SPB_MAX_SEQUENCE_REGISTERS];
+    unsigned long misses = 0;
+
+    if (count > SPB_MAX_SEQUENCE_REGISTERS)
+        return STATUS_INVALID_PARAMETER;
+
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+
+    // 8-bit registers; those without a current shadow are read in one
+    // sequence
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (!shadow_lookup(spbCtx, regs[i], &data[i]))
+        {
+            missing[misses] = regs[i];
+            slot[misses] = i;
+            misses++;
+        }
+    }
+
+    if (misses == 0)
+        return STATUS_SUCCESS;
+
+    status = SpbReadRegisters(spbCtx, missing, misses, read_buf, sizeof(read_buf[0]));
+    if (!NT_SUCCESS(status))
+        return status;
+
+    for (unsigned long i = 0; i < misses; i++)
+    {
+        data[slot[i]] = read_buf[i];
+        shadow_store(spbCtx, missing[i], read_buf[i]);
+    }
+
+    return status;
+}
+
+NTSTATUS write_regs(
+    PDEVICE_CONTEXT      pDevice,
+    unsigned long        spbIndex,
+    const unsigned char* regs,
+    const unsigned char* data,
+    unsigned long        count
+)
+{
+    NTSTATUS status;
+    unsigned char buf[SPB_MAX_SEQUENCE_REGISTERS][2];
+
+    if (count > SPB_MAX_SEQUENCE_REGISTERS)
+        return STATUS_INVALID_PARAMETER;
+
+    if (count == 0)
+        return STATUS_SUCCESS;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        // Register address, then the 8-bit value
+        buf[i][0] = regs[i];
+        buf[i][1] = data[i];
+    }
+
+    SPB_CONTEXT* spbCtx = &pDevice->SpbContexts[spbIndex];
+    status = SpbWriteMultiple(spbCtx, buf, count, sizeof(buf[0]));
+
+    // The sequence does not tell which writes landed before a failure
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (NT_SUCCESS(status))
+            shadow_store(spbCtx, regs[i], data[i]);
+        else
+            shadow_invalidate(spbCtx, regs[i]);
+    }
+
     return status;
 }
 
@@ -47,8 +301,10 @@ NTSTATUS update_reg(
     unsigned short current;
     unsigned short new_val;
 
-    // Read current 16-bit value
+    // Read current 16-bit value, from the shadow cache if it has one
     status = read_reg(pDevice, spbIndex, reg, &current);
+    if (!NT_SUCCESS(status))
+        return status;
 
     // Clear the bits defined by mask, then OR in (val & mask).
     new_val = (current & ~mask) | (val & mask);
@@ -29,4 +29,57 @@ update_reg(
 	unsigned short val
 );
 
+NTSTATUS
+read_block(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	unsigned char reg,
+	unsigned char* data,
+	unsigned short length
+);
+
+NTSTATUS
+read_blocks(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	const unsigned char* regs,
+	void** buffers,
+	const unsigned short* lengths,
+	unsigned long count
+);
+
+NTSTATUS
+update_reg8(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	unsigned char reg,
+	unsigned char mask,
+	unsigned char val
+);
+
+NTSTATUS
+read_regs(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	const unsigned char* regs,
+	unsigned long count,
+	unsigned char* data
+);
+
+NTSTATUS
+write_regs(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	const unsigned char* regs,
+	const unsigned char* data,
+	unsigned long count
+);
+
+VOID
+set_reg_cacheable(
+	PDEVICE_CONTEXT pDevice,
+	unsigned long spbIndex,
+	unsigned char reg
+);
+
 #endif // SM5714_H
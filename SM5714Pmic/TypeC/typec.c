@@ -15,4 +15,289 @@ void msleep(ULONG msec) {
 	udelay(msec * 1000);
 }
 
-// Work in progress
\ No newline at end of file
+//
+// Register access for the state machine in typec_sm.c, on the USBPD SPB
+// context. Its status codes are NTSTATUS values.
+//
+
+C_ASSERT(TYPEC_STATUS_ABNORMAL == STATUS_DEVICE_HARDWARE_ERROR);
+
+static int typec_regs_read(void* context, unsigned char reg, unsigned char* data, unsigned short length)
+{
+	return read_block((PDEVICE_CONTEXT)context, 1, reg, data, length);
+}
+
+static int typec_regs_update(void* context, unsigned char reg, unsigned char mask, unsigned char val)
+{
+	return update_reg8((PDEVICE_CONTEXT)context, 1, reg, mask, val);
+}
+
+static void typec_transition(TYPEC_PORT* port, TYPEC_STATE from, TYPEC_EVENT event, int status)
+{
+	if (status == STATUS_DEVICE_HARDWARE_ERROR)
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Abnormal device detected on CC, not sourcing\n");
+
+	Print(DEBUG_LEVEL_INFO, DBG_IOCTL, "Type-C state %d -> %d on event %d, CC_STATUS %02X status 0x%x\n",
+		from, port->State, event, port->CcStatus, status);
+}
+
+VOID typec_init(_In_ PDEVICE_CONTEXT pDevice)
+{
+	RtlZeroMemory(&pDevice->TypeC, sizeof(pDevice->TypeC));
+	pDevice->TypeC.Regs.Context = pDevice;
+	pDevice->TypeC.Regs.Read = typec_regs_read;
+	pDevice->TypeC.Regs.Update = typec_regs_update;
+	pDevice->TypeC.Transition = typec_transition;
+}
+
+int manual_JIGON(_In_ PDEVICE_CONTEXT pDevice)
+{
+	return typec_sm_manual_jigon(&pDevice->TypeC);
+}
+
+int TYPE_C_ATTACH_DRP(_In_ PDEVICE_CONTEXT pDevice)
+{
+	return typec_sm_attach_drp(&pDevice->TypeC);
+}
+
+int check_usb_killer(_In_ PDEVICE_CONTEXT pDevice)
+{
+	return typec_sm_check_usb_killer(&pDevice->TypeC);
+}
+
+int set_enable_pd_function(_In_ PDEVICE_CONTEXT pDevice)
+{
+	return typec_sm_set_pd_function(&pDevice->TypeC, TRUE);
+}
+
+NTSTATUS typec_start(_In_ PDEVICE_CONTEXT pDevice)
+{
+	pDevice->PdRxHead = 0;
+	pDevice->PdRxTail = 0;
+
+	return typec_sm_start(&pDevice->TypeC);
+}
+
+//
+// USB-PD receive path. RX_SRC and RX_HEADER_00/01 are adjacent, so one
+// block lands in Source and Header; the data objects come from RX_PAYLOAD.
+// Both blocks go out in a single sequence straight into the next free
+// ring slot, which the policy engine then reads in place. The payload
+// block is always read at its maximum size because the object count is
+// only known from the header being read in the same sequence.
+//
+
+C_ASSERT(FIELD_OFFSET(SM5714_PD_MESSAGE, Header) == SM5714_REG_RX_HEADER_00 - SM5714_REG_RX_SRC);
+C_ASSERT((SM5714_PD_RX_RING_SIZE & (SM5714_PD_RX_RING_SIZE - 1)) == 0);
+
+static VOID typec_pe_drain(_In_ PDEVICE_CONTEXT pDevice)
+{
+	LONG tail = pDevice->PdRxTail;
+
+	// Messages are handed over in place and the slot is only released
+	// once the policy engine is done with it
+	while (tail != ReadAcquire(&pDevice->PdRxHead)) {
+		typec_pe_handle_message(pDevice, &pDevice->PdRxRing[tail & (SM5714_PD_RX_RING_SIZE - 1)]);
+		tail++;
+		WriteRelease(&pDevice->PdRxTail, tail);
+	}
+}
+
+NTSTATUS typec_pd_receive(_In_ PDEVICE_CONTEXT pDevice)
+{
+	NTSTATUS status;
+	SM5714_PD_MESSAGE* slot;
+	LONG head;
+	static const unsigned char regs[2] = { SM5714_REG_RX_SRC, SM5714_REG_RX_PAYLOAD };
+	static const unsigned short lengths[2] = {
+		FIELD_OFFSET(SM5714_PD_MESSAGE, Payload),
+		RTL_FIELD_SIZE(SM5714_PD_MESSAGE, Payload)
+	};
+	void* buffers[2];
+
+	head = pDevice->PdRxHead;
+
+	// Make room before reading: RX_DONE was already cleared with INT4, so
+	// a message that is not read now is not signalled again
+	if (head - ReadAcquire(&pDevice->PdRxTail) >= SM5714_PD_RX_RING_SIZE)
+		typec_pe_drain(pDevice);
+
+	// Still full, drop the message rather than overwrite one the policy
+	// engine has not consumed yet
+	if (head - ReadAcquire(&pDevice->PdRxTail) >= SM5714_PD_RX_RING_SIZE) {
+		pDevice->PdRxDropped++;
+		return STATUS_DEVICE_BUSY;
+	}
+
+	slot = &pDevice->PdRxRing[head & (SM5714_PD_RX_RING_SIZE - 1)];
+	buffers[0] = &slot->Source;
+	buffers[1] = slot->Payload;
+
+	status = read_blocks(pDevice, 1, regs, buffers, lengths, ARRAYSIZE(regs));
+	if (!NT_SUCCESS(status)) {
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Error reading PD message - %!STATUS!", status);
+		return status;
+	}
+
+	// Publish the slot to the policy engine
+	WriteRelease(&pDevice->PdRxHead, head + 1);
+	return status;
+}
+
+VOID typec_pe_handle_message(_In_ PDEVICE_CONTEXT pDevice, _In_ const SM5714_PD_MESSAGE* msg)
+{
+	USHORT header = (USHORT)(msg->Header[0] | (msg->Header[1] << 8));
+	ULONG objects = PD_HEADER_DATA_OBJECTS(header);
+
+	UNREFERENCED_PARAMETER(pDevice);
+
+	Print(DEBUG_LEVEL_INFO, DBG_IOCTL, "PD RX src %02X type %u id %u objects %lu rev %u\n",
+		msg->Source,
+		PD_HEADER_MESSAGE_TYPE(header),
+		PD_HEADER_MESSAGE_ID(header),
+		objects,
+		PD_HEADER_SPEC_REV(header));
+
+	if (objects == 0 || PD_HEADER_EXTENDED(header))
+		return;
+
+	switch (PD_HEADER_MESSAGE_TYPE(header)) {
+	case PD_DATA_SOURCE_CAPABILITIES:
+		for (ULONG i = 0; i < objects; i++) {
+			const UCHAR* p = &msg->Payload[i * 4];
+			ULONG pdo = p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+
+			if (PD_PDO_TYPE(pdo) == PD_PDO_TYPE_FIXED) {
+				Print(DEBUG_LEVEL_INFO, DBG_IOCTL, "  PDO %lu: fixed %lu mV %lu mA\n",
+					i + 1, PD_PDO_FIXED_VOLTAGE_MV(pdo), PD_PDO_FIXED_CURRENT_MA(pdo));
+			}
+			else {
+				Print(DEBUG_LEVEL_INFO, DBG_IOCTL, "  PDO %lu: type %lu raw %08lX\n",
+					i + 1, PD_PDO_TYPE(pdo), pdo);
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+VOID typec_handle_interrupts(_In_ PDEVICE_CONTEXT pDevice, _In_reads_(SM5714_USBPD_INT_COUNT) const UCHAR* intr)
+{
+	if (intr[3] & SM5714_REG_INT_STATUS4_RX_DONE) {
+		typec_pd_receive(pDevice);
+		typec_pe_drain(pDevice);
+	}
+
+	typec_sm_handle_int1(&pDevice->TypeC, intr[0]);
+}
+
+//
+// USBPD interrupt. INT1..INT5 and STATUS1..STATUS5 are contiguous blocks
+// of 8-bit registers that the device walks through on a burst read, so
+// each block is one pointer write plus one read in a single sequence.
+// Reading INT1..INT5 clears them, which acknowledges the interrupt in the
+// same sequence.
+//
+
+EVT_WDF_INTERRUPT_ISR typec_evt_interrupt_isr;
+EVT_WDF_INTERRUPT_WORKITEM typec_evt_interrupt_workitem;
+
+NTSTATUS typec_create_interrupt(
+	_In_ PDEVICE_CONTEXT pDevice,
+	_In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+	_In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated)
+{
+	NTSTATUS status;
+	WDF_INTERRUPT_CONFIG config;
+
+	WDF_INTERRUPT_CONFIG_INIT(&config, typec_evt_interrupt_isr, NULL);
+
+	config.PassiveHandling = TRUE;
+	config.EvtInterruptWorkItem = typec_evt_interrupt_workitem;
+	config.InterruptRaw = InterruptRaw;
+	config.InterruptTranslated = InterruptTranslated;
+
+	status = WdfInterruptCreate(pDevice->FxDevice, &config, WDF_NO_OBJECT_ATTRIBUTES, &pDevice->PdInterruptObject);
+	if (!NT_SUCCESS(status)) {
+		Print(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfInterruptCreate failed for USBPD interrupt 0x%x\n", status);
+		pDevice->PdInterruptObject = NULL;
+	}
+
+	return status;
+}
+
+NTSTATUS typec_read_interrupts(_In_ PDEVICE_CONTEXT pDevice, _Out_ BOOLEAN* pending)
+{
+	NTSTATUS status;
+	UCHAR intr[SM5714_USBPD_INT_COUNT];
+	UCHAR stat[SM5714_USBPD_INT_COUNT];
+	static const unsigned char regs[] = { SM5714_REG_INT1, SM5714_REG_STATUS1 };
+	static const unsigned short lengths[] = { sizeof(intr), sizeof(stat) };
+	void* buffers[] = { intr, stat };
+	UCHAR any = 0;
+
+	*pending = FALSE;
+
+	status = read_blocks(pDevice, 1, regs, buffers, lengths, ARRAYSIZE(regs));
+	if (!NT_SUCCESS(status)) {
+		Print(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Error reading USBPD INT1..INT5 and STATUS1..STATUS5 - %!STATUS!", status);
+		return status;
+	}
+
+	WdfWaitLockAcquire(pDevice->DataLock, NULL);
+
+	for (int i = 0; i < SM5714_USBPD_INT_COUNT; i++) {
+		pDevice->PdIntPending[i] |= intr[i];
+		pDevice->PdStatus[i] = stat[i];
+		any |= intr[i];
+	}
+
+	WdfWaitLockRelease(pDevice->DataLock);
+
+	*pending = (any != 0);
+	return status;
+}
+
+BOOLEAN typec_evt_interrupt_isr(WDFINTERRUPT Interrupt, ULONG MessageID)
+{
+	PDEVICE_CONTEXT pDevice;
+	BOOLEAN pending;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(MessageID);
+
+	pDevice = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
+
+	status = typec_read_interrupts(pDevice, &pending);
+	if (!NT_SUCCESS(status) || !pending)
+		return FALSE;
+
+	WdfInterruptQueueWorkItemForIsr(Interrupt);
+	return TRUE;
+}
+
+VOID typec_evt_interrupt_workitem(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject)
+{
+	PDEVICE_CONTEXT pDevice;
+	UCHAR intr[SM5714_USBPD_INT_COUNT];
+	UCHAR stat[SM5714_USBPD_INT_COUNT];
+
+	UNREFERENCED_PARAMETER(Interrupt);
+
+	pDevice = GetDeviceContext((WDFDEVICE)AssociatedObject);
+
+	WdfWaitLockAcquire(pDevice->DataLock, NULL);
+	RtlCopyMemory(intr, pDevice->PdIntPending, sizeof(intr));
+	RtlCopyMemory(stat, pDevice->PdStatus, sizeof(stat));
+	RtlZeroMemory(pDevice->PdIntPending, sizeof(pDevice->PdIntPending));
+	WdfWaitLockRelease(pDevice->DataLock);
+
+	Print(DEBUG_LEVEL_INFO, DBG_IOCTL,
+		"USBPD INT %02X %02X %02X %02X %02X STATUS %02X %02X %02X %02X %02X\n",
+		intr[0], intr[1], intr[2], intr[3], intr[4],
+		stat[0], stat[1], stat[2], stat[3], stat[4]);
+
+	typec_handle_interrupts(pDevice, intr);
+}
\ No newline at end of file
@@ -8,4 +8,18 @@ int manual_JIGON(_In_ PDEVICE_CONTEXT pDevice);
 int TYPE_C_ATTACH_DRP(_In_ PDEVICE_CONTEXT pDevice);
 int check_usb_killer(_In_ PDEVICE_CONTEXT pDevice);
 int set_enable_pd_function(_In_ PDEVICE_CONTEXT pDevice);
+
+// USBPD interrupt
+NTSTATUS typec_create_interrupt(
+	_In_ PDEVICE_CONTEXT pDevice,
+	_In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw,
+	_In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated);
+NTSTATUS typec_read_interrupts(_In_ PDEVICE_CONTEXT pDevice, _Out_ BOOLEAN* pending);
+
+// Type-C state machine, see typec_sm.h
+VOID typec_init(_In_ PDEVICE_CONTEXT pDevice);
+NTSTATUS typec_start(_In_ PDEVICE_CONTEXT pDevice);
+NTSTATUS typec_pd_receive(_In_ PDEVICE_CONTEXT pDevice);
+VOID typec_pe_handle_message(_In_ PDEVICE_CONTEXT pDevice, _In_ const SM5714_PD_MESSAGE* msg);
+VOID typec_handle_interrupts(_In_ PDEVICE_CONTEXT pDevice, _In_reads_(SM5714_USBPD_INT_COUNT) const UCHAR* intr);
 #endif // _TYPEC_H_
@@ -0,0 +1,176 @@
+#include <stddef.h>
+
+// Forward slashes so the host side tests build this file unchanged
+#include "../Common/registers.h"
+#include "typec_sm.h"
+
+//
+// Type-C role handling. The part toggles its CC pull-ups/pull-downs on its
+// own in DRP mode and reports the resolved attach in CC_STATUS; the driver
+// follows with the state machine below.
+//
+
+int typec_sm_manual_jigon(TYPEC_PORT* port)
+{
+	// Drive JIGON by hand instead of from the RID detection
+	return port->Regs.Update(port->Regs.Context, SM5714_REG_JIGON_CONTROL,
+		SM5714_JIGON_MANUAL | SM5714_JIGON_ON,
+		SM5714_JIGON_MANUAL | SM5714_JIGON_ON);
+}
+
+int typec_sm_attach_drp(TYPEC_PORT* port)
+{
+	// Back to dual role toggling, waiting for the next attach
+	return port->Regs.Update(port->Regs.Context, SM5714_REG_CC_CNTL1, SM5714_CC_OP_MODE_MASK, SM5714_CC_OP_MODE_DRP);
+}
+
+int typec_sm_check_usb_killer(TYPEC_PORT* port)
+{
+	int status;
+	unsigned char status1;
+
+	// An abnormal device on CC (such as a USB killer) is flagged in STATUS1
+	status = port->Regs.Read(port->Regs.Context, SM5714_REG_STATUS1, &status1, sizeof(status1));
+	if (!TYPEC_SUCCESS(status))
+		return status;
+
+	if (status1 & SM5714_REG_INT_STATUS1_ABNORMAL_DEV)
+		return TYPEC_STATUS_ABNORMAL;
+
+	return 0;
+}
+
+int typec_sm_set_pd_function(TYPEC_PORT* port, int enable)
+{
+	return port->Regs.Update(port->Regs.Context, SM5714_REG_PD_CNTL1, SM5714_PD_CNTL1_ENABLE, enable ? SM5714_PD_CNTL1_ENABLE : 0);
+}
+
+//
+// Table driven state machine. Every event is looked up for the current
+// state; a missing entry means the event is ignored in that state. When
+// an entry action fails the port goes back to unattached DRP toggling.
+//
+
+typedef int (*TYPEC_ACTION)(TYPEC_PORT* port);
+
+typedef struct _TYPEC_TRANSITION {
+	TYPEC_STATE State;
+	TYPEC_EVENT Event;
+	TYPEC_STATE Next;
+	TYPEC_ACTION Action;
+} TYPEC_TRANSITION;
+
+static int typec_enter_src(TYPEC_PORT* port)
+{
+	int status;
+
+	status = typec_sm_check_usb_killer(port);
+	if (!TYPEC_SUCCESS(status))
+		return status;
+
+	return typec_sm_set_pd_function(port, 1);
+}
+
+static int typec_enter_snk(TYPEC_PORT* port)
+{
+	return typec_sm_set_pd_function(port, 1);
+}
+
+static int typec_enter_unattached(TYPEC_PORT* port)
+{
+	int status;
+
+	status = typec_sm_set_pd_function(port, 0);
+	if (!TYPEC_SUCCESS(status))
+		return status;
+
+	return typec_sm_attach_drp(port);
+}
+
+static const TYPEC_TRANSITION typec_transitions[] = {
+	{ TYPEC_STATE_UNATTACHED,   TYPEC_EVENT_ATTACH_SRC,       TYPEC_STATE_ATTACHED_SRC, typec_enter_src },
+	{ TYPEC_STATE_UNATTACHED,   TYPEC_EVENT_ATTACH_SNK,       TYPEC_STATE_ATTACHED_SNK, typec_enter_snk },
+	{ TYPEC_STATE_UNATTACHED,   TYPEC_EVENT_ATTACH_ACCESSORY, TYPEC_STATE_ACCESSORY,    NULL },
+	{ TYPEC_STATE_ATTACHED_SRC, TYPEC_EVENT_DETACH,           TYPEC_STATE_UNATTACHED,   typec_enter_unattached },
+	{ TYPEC_STATE_ATTACHED_SRC, TYPEC_EVENT_ABNORMAL,         TYPEC_STATE_UNATTACHED,   typec_enter_unattached },
+	{ TYPEC_STATE_ATTACHED_SNK, TYPEC_EVENT_DETACH,           TYPEC_STATE_UNATTACHED,   typec_enter_unattached },
+	{ TYPEC_STATE_ACCESSORY,    TYPEC_EVENT_DETACH,           TYPEC_STATE_UNATTACHED,   typec_enter_unattached },
+};
+
+int typec_sm_dispatch(TYPEC_PORT* port, TYPEC_EVENT event)
+{
+	TYPEC_STATE from = port->State;
+	int status;
+
+	for (unsigned int i = 0; i < sizeof(typec_transitions) / sizeof(typec_transitions[0]); i++) {
+		const TYPEC_TRANSITION* t = &typec_transitions[i];
+
+		if (t->State != port->State || t->Event != event)
+			continue;
+
+		status = (t->Action != NULL) ? t->Action(port) : 0;
+
+		port->State = t->Next;
+
+		if (!TYPEC_SUCCESS(status) && t->Next != TYPEC_STATE_UNATTACHED) {
+			port->State = TYPEC_STATE_UNATTACHED;
+			typec_enter_unattached(port);
+		}
+
+		if (port->Transition != NULL)
+			port->Transition(port, from, event, status);
+
+		return status;
+	}
+
+	return 0;
+}
+
+int typec_sm_dispatch_attach(TYPEC_PORT* port)
+{
+	int status;
+
+	status = port->Regs.Read(port->Regs.Context, SM5714_REG_CC_STATUS, &port->CcStatus, sizeof(port->CcStatus));
+	if (!TYPEC_SUCCESS(status))
+		return status;
+
+	switch (port->CcStatus & SM5714_ATTACH_TYPE) {
+	case SM5714_ATTACH_SOURCE:
+		return typec_sm_dispatch(port, TYPEC_EVENT_ATTACH_SRC);
+	case SM5714_ATTACH_SINK:
+		return typec_sm_dispatch(port, TYPEC_EVENT_ATTACH_SNK);
+	case SM5714_ATTACH_AUDIO:
+	case SM5714_ATTACH_DEBUG:
+		return typec_sm_dispatch(port, TYPEC_EVENT_ATTACH_ACCESSORY);
+	default:
+		return 0;
+	}
+}
+
+int typec_sm_start(TYPEC_PORT* port)
+{
+	int status;
+
+	port->State = TYPEC_STATE_UNATTACHED;
+
+	status = typec_sm_attach_drp(port);
+	if (!TYPEC_SUCCESS(status))
+		return status;
+
+	// Pick up a partner that attached before the interrupt was connected
+	typec_sm_dispatch_attach(port);
+	return status;
+}
+
+void typec_sm_handle_int1(TYPEC_PORT* port, unsigned char int1)
+{
+	// A fast unplug and replug can latch both, handle them in order
+	if (int1 & SM5714_REG_INT_STATUS1_DETACH)
+		typec_sm_dispatch(port, TYPEC_EVENT_DETACH);
+
+	if (int1 & SM5714_REG_INT_STATUS1_ABNORMAL_DEV)
+		typec_sm_dispatch(port, TYPEC_EVENT_ABNORMAL);
+
+	if (int1 & SM5714_REG_INT_STATUS1_ATTACH)
+		typec_sm_dispatch_attach(port);
+}
@@ -0,0 +1,65 @@
+#ifndef _TYPEC_SM_H_
+#define _TYPEC_SM_H_
+
+//
+// Type-C attach state machine. Free of any OS dependency: every register
+// access goes through TYPEC_REGS, which the driver backs with the SPB
+// helpers and the host side tests with a simulated register file.
+//
+
+// Type-C states, see typec_transitions in typec_sm.c
+typedef enum _TYPEC_STATE {
+	TYPEC_STATE_UNATTACHED,
+	TYPEC_STATE_ATTACHED_SRC,
+	TYPEC_STATE_ATTACHED_SNK,
+	TYPEC_STATE_ACCESSORY,
+} TYPEC_STATE;
+
+typedef enum _TYPEC_EVENT {
+	TYPEC_EVENT_ATTACH_SRC,
+	TYPEC_EVENT_ATTACH_SNK,
+	TYPEC_EVENT_ATTACH_ACCESSORY,
+	TYPEC_EVENT_DETACH,
+	TYPEC_EVENT_ABNORMAL,
+} TYPEC_EVENT;
+
+// Status codes follow NTSTATUS: negative is a failure
+#define TYPEC_SUCCESS(s)        ((int)(s) >= 0)
+#define TYPEC_STATUS_ABNORMAL   ((int)0xC0000182)   // STATUS_DEVICE_HARDWARE_ERROR
+
+// Access to the 8-bit USBPD registers
+typedef struct _TYPEC_REGS {
+	void* Context;
+
+	// Reads length consecutive registers starting at reg
+	int (*Read)(void* Context, unsigned char reg, unsigned char* data, unsigned short length);
+
+	// Read-modify-write of the bits in mask
+	int (*Update)(void* Context, unsigned char reg, unsigned char mask, unsigned char val);
+} TYPEC_REGS;
+
+typedef struct _TYPEC_PORT {
+	TYPEC_REGS Regs;
+	TYPEC_STATE State;
+
+	// CC_STATUS as read for the last attach
+	unsigned char CcStatus;
+
+	// Optional, called after every transition with the entry action's
+	// status; State is already the new state
+	void (*Transition)(struct _TYPEC_PORT* port, TYPEC_STATE from, TYPEC_EVENT event, int status);
+} TYPEC_PORT;
+
+// Register level operations
+int typec_sm_manual_jigon(TYPEC_PORT* port);
+int typec_sm_attach_drp(TYPEC_PORT* port);
+int typec_sm_check_usb_killer(TYPEC_PORT* port);
+int typec_sm_set_pd_function(TYPEC_PORT* port, int enable);
+
+// State machine
+int typec_sm_start(TYPEC_PORT* port);
+int typec_sm_dispatch(TYPEC_PORT* port, TYPEC_EVENT event);
+int typec_sm_dispatch_attach(TYPEC_PORT* port);
+void typec_sm_handle_int1(TYPEC_PORT* port, unsigned char int1);
+
+#endif // _TYPEC_SM_H_
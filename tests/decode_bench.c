@@ -0,0 +1,84 @@
+/*
+ * decode_bench.c
+ *
+ * Host side benchmark of the SM5714Battery_decode.h batch decoders. The
+ * Makefile builds it once per SM5714_DECODE_USE_TABLES mode so the table
+ * path can be compared against the arithmetic path on the same input:
+ *
+ *   make -C tests bench
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "SM5714Battery_decode.h"
+
+#define WORD_COUNT   4096
+#define ROUNDS       20000
+
+static unsigned short raw[WORD_COUNT];
+static unsigned long outUnsigned[WORD_COUNT];
+static long outSigned[WORD_COUNT];
+
+static double NowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// The checksum keeps the compiler from dropping the decode loops
+static volatile unsigned long sink;
+
+static void Report(const char* decoder, double elapsedNs)
+{
+	printf("  %-12s %7.3f ns/word\n", decoder, elapsedNs / ((double)WORD_COUNT * ROUNDS));
+}
+
+int main(void)
+{
+	unsigned long i;
+	unsigned long round;
+	unsigned long seed = 1;
+	double start;
+
+	// Fixed seed, every build decodes the same words
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		raw[i] = (unsigned short)(seed >> 16);
+	}
+
+	printf("decode_bench (SM5714_DECODE_USE_TABLES=%d), %d words x %d rounds\n",
+		SM5714_DECODE_USE_TABLES, WORD_COUNT, ROUNDS);
+
+	start = NowNs();
+	for (round = 0; round < ROUNDS; round++)
+	{
+		SM5714FgDecodeVoltageBatch(raw, outUnsigned, WORD_COUNT);
+		sink += outUnsigned[round % WORD_COUNT];
+	}
+	Report("voltage", NowNs() - start);
+
+	start = NowNs();
+	for (round = 0; round < ROUNDS; round++)
+	{
+		SM5714FgDecodeCurrentBatch(raw, outSigned, WORD_COUNT);
+		sink += (unsigned long)outSigned[round % WORD_COUNT];
+	}
+	Report("current", NowNs() - start);
+
+	start = NowNs();
+	for (round = 0; round < ROUNDS; round++)
+	{
+		SM5714FgDecodeTemperatureBatch(raw, outSigned, WORD_COUNT);
+		sink += (unsigned long)outSigned[round % WORD_COUNT];
+	}
+	Report("temperature", NowNs() - start);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+ * decode_test.c
+ *
+ * Host side check of SM5714Battery_decode.h. Every decoder, scalar and
+ * batch, is compared against the macros the driver used before the header
+ * existed, for all 65536 input words. The Makefile builds this file once
+ * per SM5714_DECODE_USE_TABLES mode.
+ */
+
+#include <stdio.h>
+
+#include "SM5714Battery_decode.h"
+
+//
+// Reference decoders: the integer and fraction parts decoded separately.
+//
+
+#define REF_DECODE_SOC(raw) \
+	((((raw) & 0xff00) >> 8) * 10 + ((((raw) & 0xff) * 10) / 256))
+
+#define REF_DECODE_VOLTAGE(raw) \
+	((((raw) & 0x3800) >> 11) * 1000 + ((((raw) & 0x07ff) * 1000) / 2048))
+
+#define REF_DECODE_CURRENT(raw) \
+	(((raw) & 0x8000) ? -(long)((((raw) & 0x1800) >> 11) * 1000 + ((((raw) & 0x07ff) * 1000) / 2048)) \
+	                  :  (long)((((raw) & 0x1800) >> 11) * 1000 + ((((raw) & 0x07ff) * 1000) / 2048)))
+
+#define REF_DECODE_TEMPERATURE(raw) \
+	(((raw) & 0x8000) ? -(long)((((raw) & 0x7fff) >> 8) * 10 + ((((raw) & 0x00f0) * 10) / 256)) \
+	                  :  (long)((((raw) & 0x7fff) >> 8) * 10 + ((((raw) & 0x00f0) * 10) / 256)))
+
+#define WORD_COUNT 65536
+
+static unsigned short raw[WORD_COUNT];
+static unsigned long outUnsigned[WORD_COUNT];
+static long outSigned[WORD_COUNT];
+
+static unsigned long failures;
+
+static void Fail(const char* decoder, unsigned long word, long expected, long actual)
+{
+	// Only the first few mismatches of a run are worth reading
+	if (failures < 16)
+	{
+		fprintf(stderr, "%s(0x%04lx): expected %ld, got %ld\n", decoder, word, expected, actual);
+	}
+
+	failures++;
+}
+
+int main(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		raw[i] = (unsigned short)i;
+	}
+
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		if (SM5714FgDecodeSoc(raw[i]) != REF_DECODE_SOC(i))
+			Fail("SM5714FgDecodeSoc", i, (long)REF_DECODE_SOC(i), (long)SM5714FgDecodeSoc(raw[i]));
+
+		if (SM5714FgDecodeVoltage(raw[i]) != REF_DECODE_VOLTAGE(i))
+			Fail("SM5714FgDecodeVoltage", i, (long)REF_DECODE_VOLTAGE(i), (long)SM5714FgDecodeVoltage(raw[i]));
+
+		if (SM5714FgDecodeCurrent(raw[i]) != REF_DECODE_CURRENT(i))
+			Fail("SM5714FgDecodeCurrent", i, REF_DECODE_CURRENT(i), SM5714FgDecodeCurrent(raw[i]));
+
+		if (SM5714FgDecodeTemperature(raw[i]) != REF_DECODE_TEMPERATURE(i))
+			Fail("SM5714FgDecodeTemperature", i, REF_DECODE_TEMPERATURE(i), SM5714FgDecodeTemperature(raw[i]));
+	}
+
+	SM5714FgDecodeSocBatch(raw, outUnsigned, WORD_COUNT);
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		if (outUnsigned[i] != REF_DECODE_SOC(i))
+			Fail("SM5714FgDecodeSocBatch", i, (long)REF_DECODE_SOC(i), (long)outUnsigned[i]);
+	}
+
+	SM5714FgDecodeVoltageBatch(raw, outUnsigned, WORD_COUNT);
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		if (outUnsigned[i] != REF_DECODE_VOLTAGE(i))
+			Fail("SM5714FgDecodeVoltageBatch", i, (long)REF_DECODE_VOLTAGE(i), (long)outUnsigned[i]);
+	}
+
+	SM5714FgDecodeCurrentBatch(raw, outSigned, WORD_COUNT);
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		if (outSigned[i] != REF_DECODE_CURRENT(i))
+			Fail("SM5714FgDecodeCurrentBatch", i, REF_DECODE_CURRENT(i), outSigned[i]);
+	}
+
+	SM5714FgDecodeTemperatureBatch(raw, outSigned, WORD_COUNT);
+	for (i = 0; i < WORD_COUNT; i++)
+	{
+		if (outSigned[i] != REF_DECODE_TEMPERATURE(i))
+			Fail("SM5714FgDecodeTemperatureBatch", i, REF_DECODE_TEMPERATURE(i), outSigned[i]);
+	}
+
+	printf("decode_test (SM5714_DECODE_USE_TABLES=%d): %lu mismatches in %d words\n",
+		SM5714_DECODE_USE_TABLES, failures, WORD_COUNT);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+/*
+ * trace_test.c
+ *
+ * Host side check of SM5714I2cTraceFormat and of the trace tool's buffer
+ * decoding, on buffers laid out like an IOCTL_SM5714_BATTERY_READ_I2C_TRACE
+ * drain.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SM5714Battery_trace.h"
+#include "trace_print.h"
+
+static unsigned long failures;
+
+static void Expect(int condition, const char* what)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static void InitRecord(SM5714_I2C_TRACE_RECORD* record, unsigned long long sequence)
+{
+	memset(record, 0, sizeof(*record));
+	record->Sequence = sequence;
+	record->Timestamp = 12345670;
+	record->DurationUs = 87;
+	record->Status = 0;
+	record->Type = SM5714_I2C_TRACE_READ;
+	record->Register = 0x0d;
+	record->SendLength = 1;
+	record->ReceiveLength = 2;
+	record->Payload[0] = 0x0d;
+	record->Payload[1] = 0x34;
+	record->Payload[2] = 0x12;
+}
+
+static void TestFormat(void)
+{
+	SM5714_I2C_TRACE_RECORD record;
+	char line[256];
+	char small[8];
+	unsigned long length;
+	unsigned long i;
+
+	InitRecord(&record, 42);
+	length = SM5714I2cTraceFormat(&record, line, sizeof(line));
+	Expect(strcmp(line, "42 1234567 READ reg=0D 87us status=00000000 tx=0D rx=3412") == 0, "format of a read");
+	Expect(length == strlen(line), "format returns the line length");
+
+	// A failed write with more payload than a record holds
+	record.Type = SM5714_I2C_TRACE_WRITE;
+	record.Status = (int)0xC00000B5;
+	record.SendLength = 40;
+	record.ReceiveLength = 0;
+	for (i = 0; i < SM5714_I2C_TRACE_PAYLOAD_SIZE; i++)
+	{
+		record.Payload[i] = (unsigned char)i;
+	}
+
+	SM5714I2cTraceFormat(&record, line, sizeof(line));
+	Expect(strncmp(line, "42 1234567 WRITE reg=0D 87us status=C00000B5 tx=000102", 54) == 0, "format of a failed write");
+	Expect(strlen(line) == 54 + (SM5714_I2C_TRACE_PAYLOAD_SIZE - 3) * 2, "payload truncated to the record");
+	Expect(strstr(line, "rx=") == NULL, "no rx for a write");
+
+	// Unknown types still format, truncation keeps the terminator
+	record.Type = 0x7f;
+	SM5714I2cTraceFormat(&record, line, sizeof(line));
+	Expect(strstr(line, " UNKNOWN ") != NULL, "unknown type name");
+
+	length = SM5714I2cTraceFormat(&record, small, sizeof(small));
+	Expect(length == sizeof(small) - 1 && strcmp(small, "42 1234") == 0, "format truncated to size");
+}
+
+static int PrintToString(const void* buffer, unsigned long length, unsigned long long* last, unsigned int* count, char* text, size_t size)
+{
+	FILE* out = tmpfile();
+	size_t read;
+	int result;
+
+	if (out == NULL)
+	{
+		return -2;
+	}
+
+	result = SM5714I2cTracePrint(out, buffer, length, last, count);
+
+	rewind(out);
+	read = fread(text, 1, size - 1, out);
+	text[read] = '\0';
+	fclose(out);
+
+	return result;
+}
+
+static void TestPrint(void)
+{
+	struct
+	{
+		SM5714_I2C_TRACE_HEADER Header;
+		SM5714_I2C_TRACE_RECORD Records[2];
+	} drain;
+	unsigned long long last = 0;
+	unsigned int count = 0;
+	char text[1024];
+
+	memset(&drain, 0, sizeof(drain));
+	drain.Header.Version = SM5714_I2C_TRACE_VERSION;
+	drain.Header.RecordSize = sizeof(SM5714_I2C_TRACE_RECORD);
+	drain.Header.RecordCount = 2;
+	drain.Header.Dropped = 3;
+	drain.Header.LastSequence = 8;
+	InitRecord(&drain.Records[0], 7);
+	InitRecord(&drain.Records[1], 8);
+	drain.Records[1].Type = SM5714_I2C_TRACE_INTERRUPT_READ;
+
+	Expect(PrintToString(&drain, sizeof(drain), &last, &count, text, sizeof(text)) == 0, "print of a drain");
+	Expect(strcmp(text,
+		"# 3 records dropped\n"
+		"7 1234567 READ reg=0D 87us status=00000000 tx=0D rx=3412\n"
+		"8 1234567 INTERRUPT_READ reg=0D 87us status=00000000 tx=0D rx=3412\n") == 0, "printed drain");
+	Expect(last == 8 && count == 2, "next drain follows LastSequence");
+
+	// An empty drain keeps the position
+	drain.Header.RecordCount = 0;
+	drain.Header.Dropped = 0;
+	Expect(PrintToString(&drain, sizeof(drain.Header), &last, &count, text, sizeof(text)) == 0, "print of an empty drain");
+	Expect(text[0] == '\0' && last == 8 && count == 0, "empty drain");
+
+	// Buffers the tool does not understand are rejected untouched
+	last = 5;
+	drain.Header.RecordCount = 2;
+	Expect(PrintToString(&drain, sizeof(drain) - 1, &last, &count, text, sizeof(text)) == -1, "short buffer rejected");
+	Expect(text[0] == '\0' && last == 5, "nothing printed for a short buffer");
+
+	drain.Header.Version = SM5714_I2C_TRACE_VERSION + 1;
+	Expect(PrintToString(&drain, sizeof(drain), &last, &count, text, sizeof(text)) == -1, "other version rejected");
+
+	drain.Header.Version = SM5714_I2C_TRACE_VERSION;
+	drain.Header.RecordSize = sizeof(SM5714_I2C_TRACE_RECORD) + 8;
+	Expect(PrintToString(&drain, sizeof(drain), &last, &count, text, sizeof(text)) == -1, "other record size rejected");
+
+	Expect(PrintToString(&drain, 4, &last, &count, text, sizeof(text)) == -1, "truncated header rejected");
+}
+
+int main(void)
+{
+	TestFormat();
+	TestPrint();
+
+	printf("trace_test: %lu failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,325 @@
+/*
+ * typec_test.c
+ *
+ * Host side test of the Type-C attach state machine in typec_sm.c, run
+ * against a simulated USBPD register file instead of the SPB bus.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "registers.h"
+#include "typec_sm.h"
+
+#define SIM_STATUS_IO_ERROR ((int)0xC0000185)   // STATUS_IO_DEVICE_ERROR
+
+//
+// Simulated register file. Every access can be made to fail by register,
+// and updates are counted so tests can tell which registers were written.
+//
+
+typedef struct _SIM_DEVICE {
+	unsigned char Regs[256];
+	int FailReg;
+	unsigned int Updates[256];
+	unsigned int Transitions;
+	TYPEC_STATE LastFrom;
+	int LastStatus;
+} SIM_DEVICE;
+
+static int SimRead(void* context, unsigned char reg, unsigned char* data, unsigned short length)
+{
+	SIM_DEVICE* sim = (SIM_DEVICE*)context;
+	unsigned short i;
+
+	for (i = 0; i < length; i++)
+	{
+		if ((int)(unsigned char)(reg + i) == sim->FailReg)
+			return SIM_STATUS_IO_ERROR;
+
+		data[i] = sim->Regs[(unsigned char)(reg + i)];
+	}
+
+	return 0;
+}
+
+static int SimUpdate(void* context, unsigned char reg, unsigned char mask, unsigned char val)
+{
+	SIM_DEVICE* sim = (SIM_DEVICE*)context;
+
+	if (reg == sim->FailReg)
+		return SIM_STATUS_IO_ERROR;
+
+	sim->Regs[reg] = (unsigned char)((sim->Regs[reg] & ~mask) | (val & mask));
+	sim->Updates[reg]++;
+	return 0;
+}
+
+static void SimTransition(TYPEC_PORT* port, TYPEC_STATE from, TYPEC_EVENT event, int status)
+{
+	SIM_DEVICE* sim = (SIM_DEVICE*)port->Regs.Context;
+
+	(void)event;
+
+	sim->Transitions++;
+	sim->LastFrom = from;
+	sim->LastStatus = status;
+}
+
+static void SimInit(SIM_DEVICE* sim, TYPEC_PORT* port, unsigned char ccStatus)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->FailReg = -1;
+
+	// Power-on values: DRP off, PD off, partner as given
+	sim->Regs[SM5714_REG_CC_CNTL1] = SM5714_CC_OP_MODE_SNK | 0x80;
+	sim->Regs[SM5714_REG_PD_CNTL1] = 0x40;
+	sim->Regs[SM5714_REG_CC_STATUS] = ccStatus;
+
+	memset(port, 0, sizeof(*port));
+	port->Regs.Context = sim;
+	port->Regs.Read = SimRead;
+	port->Regs.Update = SimUpdate;
+	port->Transition = SimTransition;
+	port->State = TYPEC_STATE_UNATTACHED;
+}
+
+static int PdEnabled(const SIM_DEVICE* sim)
+{
+	return (sim->Regs[SM5714_REG_PD_CNTL1] & SM5714_PD_CNTL1_ENABLE) != 0;
+}
+
+static int Drp(const SIM_DEVICE* sim)
+{
+	return (sim->Regs[SM5714_REG_CC_CNTL1] & SM5714_CC_OP_MODE_MASK) == SM5714_CC_OP_MODE_DRP;
+}
+
+static unsigned long failures;
+
+#define EXPECT(c) \
+	do { \
+		if (!(c)) { \
+			fprintf(stderr, "%s:%d: %s: FAILED: %s\n", __FILE__, __LINE__, test, #c); \
+			failures++; \
+		} \
+	} while (0)
+
+static void TestAttachSrc(void)
+{
+	static const char* test = "attach SRC";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SRC);
+	EXPECT(port.CcStatus == SM5714_ATTACH_SOURCE);
+	EXPECT(PdEnabled(&sim));
+	EXPECT(sim.Regs[SM5714_REG_PD_CNTL1] == (0x40 | SM5714_PD_CNTL1_ENABLE));
+	EXPECT(sim.Transitions == 1 && sim.LastFrom == TYPEC_STATE_UNATTACHED && sim.LastStatus == 0);
+}
+
+static void TestAttachSnk(void)
+{
+	static const char* test = "attach SNK";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	SimInit(&sim, &port, SM5714_ATTACH_SINK | SM5714_CABLE_FLIP);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SNK);
+	EXPECT(PdEnabled(&sim));
+
+	// An attach while attached is ignored
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SNK);
+	EXPECT(sim.Transitions == 1);
+}
+
+static void TestAttachAccessory(void)
+{
+	static const char* test = "attach accessory";
+	static const unsigned char types[] = { SM5714_ATTACH_AUDIO, SM5714_ATTACH_DEBUG };
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(types); i++)
+	{
+		SimInit(&sim, &port, types[i]);
+		typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+		EXPECT(port.State == TYPEC_STATE_ACCESSORY);
+		EXPECT(!PdEnabled(&sim));
+		EXPECT(sim.Updates[SM5714_REG_PD_CNTL1] == 0);
+	}
+
+	// Nothing attached: no event
+	SimInit(&sim, &port, SM5714_ATTACH_NONE);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.Transitions == 0);
+}
+
+static void TestDetach(void)
+{
+	static const char* test = "detach";
+	static const unsigned char types[] = { SM5714_ATTACH_SOURCE, SM5714_ATTACH_SINK, SM5714_ATTACH_AUDIO };
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(types); i++)
+	{
+		SimInit(&sim, &port, types[i]);
+		typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+		EXPECT(port.State != TYPEC_STATE_UNATTACHED);
+
+		sim.Regs[SM5714_REG_CC_STATUS] = SM5714_ATTACH_NONE;
+		typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_DETACH);
+
+		EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+		EXPECT(!PdEnabled(&sim));
+		EXPECT(Drp(&sim));
+		EXPECT(sim.Regs[SM5714_REG_CC_CNTL1] == (0x80 | SM5714_CC_OP_MODE_DRP));
+	}
+
+	// A detach while unattached is ignored
+	SimInit(&sim, &port, SM5714_ATTACH_NONE);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_DETACH);
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.Transitions == 0);
+	EXPECT(sim.Updates[SM5714_REG_CC_CNTL1] == 0);
+
+	// Unplug and replug latched in one interrupt: detach first, then the
+	// new partner
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+	sim.Regs[SM5714_REG_CC_STATUS] = SM5714_ATTACH_SINK;
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_DETACH | SM5714_REG_INT_STATUS1_ATTACH);
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SNK);
+	EXPECT(sim.Transitions == 3);
+	EXPECT(PdEnabled(&sim));
+}
+
+static void TestAbnormal(void)
+{
+	static const char* test = "abnormal";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SRC);
+
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ABNORMAL_DEV);
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(!PdEnabled(&sim));
+	EXPECT(Drp(&sim));
+
+	// Only a source reacts to it
+	SimInit(&sim, &port, SM5714_ATTACH_SINK);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ABNORMAL_DEV);
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SNK);
+}
+
+static void TestFailedEntry(void)
+{
+	static const char* test = "failed entry fallback";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	// USB killer on CC: sourcing is refused and the port goes back to DRP
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	sim.Regs[SM5714_REG_STATUS1] = SM5714_REG_INT_STATUS1_ABNORMAL_DEV;
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.LastStatus == TYPEC_STATUS_ABNORMAL);
+	EXPECT(!PdEnabled(&sim));
+	EXPECT(Drp(&sim));
+
+	// Bus error while enabling PD on a sink attach
+	SimInit(&sim, &port, SM5714_ATTACH_SINK);
+	sim.FailReg = SM5714_REG_PD_CNTL1;
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.LastStatus == SIM_STATUS_IO_ERROR);
+
+	// Bus error reading STATUS1 for the killer check
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	sim.FailReg = SM5714_REG_STATUS1;
+	typec_sm_handle_int1(&port, SM5714_REG_INT_STATUS1_ATTACH);
+
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(!PdEnabled(&sim));
+	EXPECT(Drp(&sim));
+
+	// CC_STATUS unreadable: no event at all
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	sim.FailReg = SM5714_REG_CC_STATUS;
+	EXPECT(typec_sm_dispatch_attach(&port) == SIM_STATUS_IO_ERROR);
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.Transitions == 0);
+}
+
+static void TestStart(void)
+{
+	static const char* test = "D0 start pickup";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	// Partner attached before the interrupt was connected
+	SimInit(&sim, &port, SM5714_ATTACH_SINK);
+	port.State = TYPEC_STATE_ATTACHED_SRC;
+
+	EXPECT(typec_sm_start(&port) == 0);
+	EXPECT(Drp(&sim));
+	EXPECT(port.State == TYPEC_STATE_ATTACHED_SNK);
+	EXPECT(PdEnabled(&sim));
+
+	// Nothing attached
+	SimInit(&sim, &port, SM5714_ATTACH_NONE);
+	EXPECT(typec_sm_start(&port) == 0);
+	EXPECT(Drp(&sim));
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.Transitions == 0);
+
+	// DRP cannot be armed
+	SimInit(&sim, &port, SM5714_ATTACH_SOURCE);
+	sim.FailReg = SM5714_REG_CC_CNTL1;
+	EXPECT(typec_sm_start(&port) == SIM_STATUS_IO_ERROR);
+	EXPECT(port.State == TYPEC_STATE_UNATTACHED);
+	EXPECT(sim.Transitions == 0);
+}
+
+static void TestManualJigon(void)
+{
+	static const char* test = "manual JIGON";
+	SIM_DEVICE sim;
+	TYPEC_PORT port;
+
+	SimInit(&sim, &port, SM5714_ATTACH_NONE);
+	sim.Regs[SM5714_REG_JIGON_CONTROL] = 0xF0;
+	EXPECT(typec_sm_manual_jigon(&port) == 0);
+	EXPECT(sim.Regs[SM5714_REG_JIGON_CONTROL] == (0xF0 | SM5714_JIGON_MANUAL | SM5714_JIGON_ON));
+}
+
+int main(void)
+{
+	TestAttachSrc();
+	TestAttachSnk();
+	TestAttachAccessory();
+	TestDetach();
+	TestAbnormal();
+	TestFailedEntry();
+	TestStart();
+	TestManualJigon();
+
+	printf("typec_test: %lu failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
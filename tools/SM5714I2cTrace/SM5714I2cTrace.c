@@ -0,0 +1,208 @@
+/*
+ * SM5714I2cTrace.c
+ *
+ * Prints the I2C transactions recorded by the SM5714 battery driver. The
+ * tool finds the battery through the GUID_DEVICE_BATTERY interface, drains
+ * the trace ring with IOCTL_SM5714_BATTERY_READ_I2C_TRACE and follows
+ * LastSequence from one drain to the next, so every record is printed
+ * once.
+ *
+ *   SM5714I2cTrace          print what is in the ring and exit
+ *   SM5714I2cTrace -f [ms]  keep following the ring, polling every ms
+ *                           milliseconds (default 500)
+ *
+ * Build from a Developer Command Prompt:
+ *
+ *   cl /W4 SM5714I2cTrace.c trace_print.c setupapi.lib
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <setupapi.h>
+#include <initguid.h>
+#include <batclass.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "..\..\SM5714Battery\inc\SM5714Battery_trace.h"
+#include "trace_print.h"
+
+// Records fetched per drain, the ring is drained again until it is empty
+#define TRACE_RECORDS_PER_DRAIN 256
+
+#define TRACE_BUFFER_SIZE \
+	(sizeof(SM5714_I2C_TRACE_HEADER) + TRACE_RECORDS_PER_DRAIN * sizeof(SM5714_I2C_TRACE_RECORD))
+
+static BOOL DrainTrace(HANDLE device, void* buffer, unsigned long long* lastSequence, unsigned int* records)
+{
+	unsigned long long seen = *lastSequence;
+	DWORD returned;
+
+	if (!DeviceIoControl(device,
+		IOCTL_SM5714_BATTERY_READ_I2C_TRACE,
+		&seen,
+		sizeof(seen),
+		buffer,
+		(DWORD)TRACE_BUFFER_SIZE,
+		&returned,
+		NULL))
+	{
+		return FALSE;
+	}
+
+	if (SM5714I2cTracePrint(stdout, buffer, returned, lastSequence, records) != 0)
+	{
+		fprintf(stderr, "Unexpected trace format, version %u expected\n", SM5714_I2C_TRACE_VERSION);
+		SetLastError(ERROR_INVALID_DATA);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//
+// Opens the first battery that answers the trace IOCTL. Other batteries in
+// the system reject it as an unsupported request.
+//
+static HANDLE OpenSm5714Battery(void* buffer)
+{
+	HDEVINFO devInfo;
+	SP_DEVICE_INTERFACE_DATA interfaceData;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA_W detail;
+	HANDLE device = INVALID_HANDLE_VALUE;
+	DWORD index;
+	DWORD required;
+	DWORD returned;
+	unsigned long long seen = 0;
+
+	devInfo = SetupDiGetClassDevsW(&GUID_DEVICE_BATTERY, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+	if (devInfo == INVALID_HANDLE_VALUE)
+	{
+		return INVALID_HANDLE_VALUE;
+	}
+
+	interfaceData.cbSize = sizeof(interfaceData);
+
+	for (index = 0;
+		device == INVALID_HANDLE_VALUE &&
+		SetupDiEnumDeviceInterfaces(devInfo, NULL, &GUID_DEVICE_BATTERY, index, &interfaceData);
+		index++)
+	{
+		required = 0;
+		SetupDiGetDeviceInterfaceDetailW(devInfo, &interfaceData, NULL, 0, &required, NULL);
+		if (required == 0)
+		{
+			continue;
+		}
+
+		detail = (PSP_DEVICE_INTERFACE_DETAIL_DATA_W)malloc(required);
+		if (detail == NULL)
+		{
+			break;
+		}
+
+		detail->cbSize = sizeof(*detail);
+
+		if (SetupDiGetDeviceInterfaceDetailW(devInfo, &interfaceData, detail, required, NULL, NULL))
+		{
+			device = CreateFileW(detail->DevicePath,
+				GENERIC_READ | GENERIC_WRITE,
+				FILE_SHARE_READ | FILE_SHARE_WRITE,
+				NULL,
+				OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL,
+				NULL);
+
+			// Probe with an empty drain request
+			if (device != INVALID_HANDLE_VALUE &&
+				!DeviceIoControl(device,
+					IOCTL_SM5714_BATTERY_READ_I2C_TRACE,
+					&seen,
+					sizeof(seen),
+					buffer,
+					sizeof(SM5714_I2C_TRACE_HEADER),
+					&returned,
+					NULL))
+			{
+				CloseHandle(device);
+				device = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		free(detail);
+	}
+
+	SetupDiDestroyDeviceInfoList(devInfo);
+	return device;
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE device;
+	void* buffer;
+	unsigned long long lastSequence = 0;
+	unsigned int records;
+	BOOL follow = FALSE;
+	DWORD intervalMs = 500;
+	int result = EXIT_SUCCESS;
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "-f") != 0 || argc > 3)
+		{
+			fprintf(stderr, "Usage: %s [-f [interval ms]]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		follow = TRUE;
+		if (argc == 3)
+		{
+			intervalMs = (DWORD)strtoul(argv[2], NULL, 10);
+		}
+	}
+
+	buffer = malloc(TRACE_BUFFER_SIZE);
+	if (buffer == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	device = OpenSm5714Battery(buffer);
+	if (device == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "No SM5714 battery answering the trace IOCTL found\n");
+		free(buffer);
+		return EXIT_FAILURE;
+	}
+
+	for (;;)
+	{
+		if (!DrainTrace(device, buffer, &lastSequence, &records))
+		{
+			fprintf(stderr, "Reading the I2C trace failed, error %lu\n", GetLastError());
+			result = EXIT_FAILURE;
+			break;
+		}
+
+		fflush(stdout);
+
+		// A full drain means more records are waiting
+		if (records == TRACE_RECORDS_PER_DRAIN)
+		{
+			continue;
+		}
+
+		if (!follow)
+		{
+			break;
+		}
+
+		Sleep(intervalMs);
+	}
+
+	CloseHandle(device);
+	free(buffer);
+	return result;
+}
@@ -0,0 +1,59 @@
+/*
+ * trace_print.c
+ *
+ * Decoding of an IOCTL_SM5714_BATTERY_READ_I2C_TRACE output buffer, see
+ * trace_print.h.
+ */
+
+#include <string.h>
+
+// Forward slashes so the host side tests build this file unchanged
+#include "../../SM5714Battery/inc/SM5714Battery_trace.h"
+#include "trace_print.h"
+
+int SM5714I2cTracePrint(
+	FILE* out,
+	const void* buffer,
+	unsigned long length,
+	unsigned long long* LastSequence,
+	unsigned int* RecordCount)
+{
+	SM5714_I2C_TRACE_HEADER header;
+	SM5714_I2C_TRACE_RECORD record;
+	const unsigned char* records;
+	char line[256];
+	unsigned int i;
+
+	if (length < sizeof(header))
+	{
+		return -1;
+	}
+
+	memcpy(&header, buffer, sizeof(header));
+
+	if (header.Version != SM5714_I2C_TRACE_VERSION ||
+		header.RecordSize != sizeof(record) ||
+		header.RecordCount > (length - sizeof(header)) / sizeof(record))
+	{
+		return -1;
+	}
+
+	if (header.Dropped != 0)
+	{
+		fprintf(out, "# %u records dropped\n", header.Dropped);
+	}
+
+	// Copied out rather than cast, the buffer comes with no alignment
+	// guarantee
+	records = (const unsigned char*)buffer + sizeof(header);
+	for (i = 0; i < header.RecordCount; i++)
+	{
+		memcpy(&record, records + (size_t)i * sizeof(record), sizeof(record));
+		SM5714I2cTraceFormat(&record, line, sizeof(line));
+		fprintf(out, "%s\n", line);
+	}
+
+	*LastSequence = header.LastSequence;
+	*RecordCount = header.RecordCount;
+	return 0;
+}
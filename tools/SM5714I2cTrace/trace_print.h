@@ -0,0 +1,30 @@
+/*
+ * trace_print.h
+ *
+ * Decoding of an IOCTL_SM5714_BATTERY_READ_I2C_TRACE output buffer into
+ * text, one line per record. Free of any OS dependency so the host side
+ * tests build it as well.
+ */
+
+#ifndef SM5714I2CTRACE_PRINT
+#define SM5714I2CTRACE_PRINT
+
+#include <stdio.h>
+
+//
+// Prints every record in buffer, as returned by the IOCTL in length bytes,
+// with SM5714I2cTraceFormat, and a comment line when the driver reports
+// dropped records. On success LastSequence receives the input for the next
+// drain and RecordCount the number of records printed.
+//
+// Returns 0 on success, -1 if the buffer is not a trace this tool
+// understands; nothing is printed then.
+//
+int SM5714I2cTracePrint(
+	FILE* out,
+	const void* buffer,
+	unsigned long length,
+	unsigned long long* LastSequence,
+	unsigned int* RecordCount);
+
+#endif /* SM5714I2CTRACE_PRINT */